@@ -85,6 +85,13 @@ static int fuse_exfat_getattr(const char* path, struct fbx_stat* stbuf)
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	/* free clusters of removed files a piece at a time */
+	exfat_reclaim(&ef, EXFAT_RECLAIM_BATCH);
+	exfat_flush_times(&ef, EXFAT_LAZYTIME_EXPIRE);
+	/* write back cached data that has been dirty for a while */
+	exfat_writeback(ef.dev);
+	exfat_scrub(ef.dev, EXFAT_SCRUB_INTERVAL);
+
 	rc = exfat_lookup(&ef, &node, path);
 	if (rc != 0)
 		return rc;
@@ -226,6 +233,9 @@ static int fuse_exfat_fsync(const char* path, int datasync,
 	int rc;
 
 	exfat_debug("[%s] %s", __func__, path);
+	rc = exfat_reclaim(&ef, UINT32_MAX);
+	if (rc != 0)
+		return rc;
 	rc = exfat_flush_nodes(&ef);
 	if (rc != 0)
 		return rc;
@@ -356,7 +366,10 @@ static int fuse_exfat_statfs(const char* path, struct statvfs* sfs)
 	sfs->f_bsize = CLUSTER_SIZE(*ef.sb);
 	sfs->f_frsize = CLUSTER_SIZE(*ef.sb);
 	sfs->f_blocks = le64_to_cpu(ef.sb->sector_count) >> ef.sb->spc_bits;
-	sfs->f_bavail = exfat_count_free_clusters(&ef);
+	/* clusters of removed files are free even if they are not reclaimed, and
+	   so are clusters reserved for appends */
+	sfs->f_bavail = exfat_count_free_clusters(&ef) + ef.reclaim_clusters +
+			ef.reserved_clusters;
 	sfs->f_bfree = sfs->f_bavail;
 	sfs->f_namemax = EXFAT_NAME_MAX;
 
@@ -578,7 +591,7 @@ int fuse_exfat_format(const char *label, ULONG dostype) {
 	struct fuse_context* cntx = fuse_get_context();
 	struct exfat_mount_data* md = cntx->private_data;
 	struct exfat_dev* dev;
-	dev = exfat_open(md->device, EXFAT_MODE_RW);
+	dev = exfat_open(md->device, EXFAT_MODE_RW, md->options);
 	if (dev == NULL)
 		return -EIO;
 
@@ -28,15 +28,26 @@
 
 #define PERCENT_PROTECTED      30
 #define PERCENT_DIRTY          30
+#define PERCENT_STREAM         30
 
 #define HIGH_THRESHOLD_PERCENT 60
 #define LOW_THRESHOLD_PERCENT  30
 
+#define MIN_HASH_SIZE          64
+
+#define MAX_WRITE_BUFFER       (256UL * 1024UL)
+#define MAX_FLUSH_GAP          (16UL * 1024UL)
+
+/* The valid and dirty masks of a page are ULONGs */
+#define MAX_PAGE_SECTORS       32
+
 struct BlockCache *InitBlockCache(struct DiskIO *dio) {
 	struct BlockCache *bc;
 	UQUAD disk_cache_size;
 	ULONG mem_cache_size;
 	ULONG min_cache_size;
+	ULONG hash_size;
+	ULONG page_size;
 
 	DEBUGF("InitBlockCache(%#p)\n", dio);
 
@@ -51,9 +62,34 @@ struct BlockCache *InitBlockCache(struct DiskIO *dio) {
 	bc->sector_shift        = dio->sector_shift;
 	bc->write_cache_enabled = dio->write_cache_enabled;
 
+	/* Pages hold between one and MAX_PAGE_SECTORS sectors. */
+	page_size = dio->cache_page_size;
+	if (page_size < bc->sector_size || (page_size & (page_size - 1)) != 0)
+		page_size = bc->sector_size;
+
+	bc->page_sectors = page_size >> bc->sector_shift;
+	if (bc->page_sectors > MAX_PAGE_SECTORS)
+		bc->page_sectors = MAX_PAGE_SECTORS;
+
+	while ((1UL << bc->page_shift) < bc->page_sectors)
+		bc->page_shift++;
+
+	bc->page_size = bc->page_sectors << bc->sector_shift;
+
+	bc->verify_mode   = dio->cache_verify;
+	bc->verify_period = MAX(dio->verify_period, 1);
+	bc->writeback_age = dio->writeback_age;
+
+	if (bc->verify_mode > DIOCV_SCRUB)
+		bc->verify_mode = DIOCV_ALWAYS;
+
 	NEWMINLIST(&bc->probation_list);
 	NEWMINLIST(&bc->protected_list);
 	NEWMINLIST(&bc->dirty_list);
+	NEWMINLIST(&bc->pinned_list);
+	NEWMINLIST(&bc->stream_list);
+	NEWMINLIST(&bc->recent_ghost_list);
+	NEWMINLIST(&bc->frequent_ghost_list);
 
 	bc->mem_handler.is_Node.ln_Type = NT_INTERRUPT;
 	bc->mem_handler.is_Node.ln_Pri  = 50;
@@ -83,23 +119,63 @@ struct BlockCache *InitBlockCache(struct DiskIO *dio) {
 	if (bc->max_cache_nodes < min_cache_size)
 		bc->max_cache_nodes = min_cache_size;
 
+	/* The cache is managed in pages from here on */
+	bc->max_cache_nodes >>= bc->page_shift;
+
 	bc->max_protected_nodes = ((UQUAD)bc->max_cache_nodes * PERCENT_PROTECTED + 50) / 100;
 	bc->max_dirty_nodes     = ((UQUAD)bc->max_cache_nodes * PERCENT_DIRTY     + 50) / 100;
+	bc->max_stream_nodes    = ((UQUAD)bc->max_cache_nodes * PERCENT_STREAM    + 50) / 100;
+
+	if (bc->max_stream_nodes == 0)
+		bc->max_stream_nodes = 1;
+
+	/* ARC sizes the protected list itself */
+	bc->cache_policy = (dio->cache_policy == DIOCP_ARC) ? DIOCP_ARC : DIOCP_SLRU;
+	if (bc->cache_policy == DIOCP_ARC)
+		bc->max_protected_nodes = bc->max_cache_nodes;
 
 	bc->high_threshold = ((UQUAD)bc->max_dirty_nodes * HIGH_THRESHOLD_PERCENT + 50) / 100;
 	bc->low_threshold  = ((UQUAD)bc->max_dirty_nodes * LOW_THRESHOLD_PERCENT  + 50) / 100;
 
+	/* Two nodes per hash chain on average when the cache is full */
+	hash_size = MIN_HASH_SIZE;
+	while (hash_size < (bc->max_cache_nodes >> 1))
+		hash_size <<= 1;
+
+	bc->hash_table = AllocPooled(bc->mempool, hash_size * sizeof(struct BlockCacheNode *));
+	if (bc->hash_table == NULL)
+		goto cleanup;
+
+	bzero(bc->hash_table, hash_size * sizeof(struct BlockCacheNode *));
+	bc->hash_mask = hash_size - 1;
+
+	if (bc->cache_policy == DIOCP_ARC) {
+		bc->ghost_table = AllocPooled(bc->mempool, hash_size * sizeof(struct GhostNode *));
+		if (bc->ghost_table == NULL)
+			goto cleanup;
+
+		bzero(bc->ghost_table, hash_size * sizeof(struct GhostNode *));
+	}
+
 	if (bc->write_cache_enabled) {
 		ULONG max_buffer_size;
 
-		max_buffer_size = (64UL * 1024UL) >> bc->sector_shift;
+		/* Every range holds at least one dirty node */
+		bc->max_ranges = bc->max_dirty_nodes + 1;
+
+		bc->range_index = AllocPooled(bc->mempool, bc->max_ranges * sizeof(struct BlockRangeNode *));
+		if (bc->range_index == NULL)
+			goto cleanup;
+
+		max_buffer_size = MAX_WRITE_BUFFER >> bc->sector_shift;
 
-		bc->write_buffer_size = bc->max_dirty_nodes;
+		bc->write_buffer_size = bc->max_dirty_nodes << bc->page_shift;
 
 		if (bc->write_buffer_size > max_buffer_size)
 			bc->write_buffer_size = max_buffer_size;
 
-		bc->write_buffer = AllocPooled(bc->mempool, bc->write_buffer_size << bc->sector_shift);
+		/* One write buffer for each request of the ring */
+		bc->write_buffer = AllocPooled(bc->mempool, (NUM_IO_REQUESTS * bc->write_buffer_size) << bc->sector_shift);
 		if (bc->write_buffer == NULL)
 			goto cleanup;
 	}
@@ -130,49 +206,151 @@ void CleanupBlockCache(struct BlockCache *bc) {
 	}
 }
 
+/*
+ * One's complement sum of the longwords. The carries are collected in the
+ * upper half of two 64-bit sums and folded back in at the end, which gives
+ * the same result as adding them back after every longword.
+ */
 static ULONG BlockChecksum(const ULONG *data, ULONG bytes) {
-	ULONG next_sum, sum = 0;
-	ULONG longs = bytes / sizeof(ULONG);
+	UQUAD sum1 = 0, sum2 = 0;
+	ULONG loops = bytes / (4 * sizeof(ULONG));
 
 	DEBUGF("BlockChecksum(%#p, %u)\n", data, bytes);
 
-	while (longs--) {
-		next_sum = sum + *data++;
-		if (next_sum < sum) next_sum++;
-		sum = next_sum;
+	while (loops--) {
+		sum1 += data[0];
+		sum2 += data[1];
+		sum1 += data[2];
+		sum2 += data[3];
+		data += 4;
+	}
+
+	sum1 += sum2;
+	sum1 = (sum1 & 0xffffffffULL) + (sum1 >> 32);
+	sum1 = (sum1 & 0xffffffffULL) + (sum1 >> 32);
+
+	return (ULONG)sum1;
+}
+
+/* Returns how many of count sectors starting at sector are in the same page. */
+static inline ULONG PageSectors(const struct BlockCache *bc, UQUAD sector, ULONG count) {
+	ULONG left = bc->page_sectors - ((ULONG)sector & (bc->page_sectors - 1));
+
+	return MIN(left, count);
+}
+
+/* Returns the valid/dirty mask bits for count sectors starting at index. */
+static inline ULONG SectorBits(ULONG index, ULONG count) {
+	return ((count < 32) ? ((1UL << count) - 1) : ~0UL) << index;
+}
+
+/* Page data is followed by the sector checksums in the same allocation. */
+static inline ULONG PageAllocSize(const struct BlockCache *bc) {
+	return bc->page_size + bc->page_sectors * sizeof(ULONG);
+}
+
+/* Updates the checksums of the sectors in mask. */
+static void UpdateChecksums(struct BlockCache *bc, struct BlockCacheNode *bcn, ULONG mask) {
+	ULONG i;
+
+	if (bc->verify_mode == DIOCV_NEVER)
+		return;
+
+	for (i = 0; mask != 0; i++, mask >>= 1) {
+		if ((mask & 1) != 0)
+			bcn->checksums[i] = BlockChecksum(bcn->data + (i << bc->sector_shift), bc->sector_size);
 	}
+}
+
+/* Checks the clean sectors in mask and returns the ones that were corrupted. */
+static ULONG VerifySectors(struct BlockCache *bc, struct BlockCacheNode *bcn, ULONG mask) {
+	ULONG bad = 0;
+	ULONG i;
+
+	mask &= bcn->valid_mask & ~bcn->dirty_mask;
+
+	for (i = 0; mask != 0; i++, mask >>= 1) {
+		if ((mask & 1) != 0 && BlockChecksum(bcn->data + (i << bc->sector_shift), bc->sector_size) != bcn->checksums[i])
+			bad |= 1UL << i;
+	}
+
+	/* Throw away corrupted cache data */
+	bcn->valid_mask &= ~bad;
 
-	return sum;
+	return bad;
 }
 
-static int CacheTreeCompareFunc(CONST_APTR key1, CONST_APTR key2) {
-	UQUAD sector1 = *(const UQUAD *)key1;
-	UQUAD sector2 = *(const UQUAD *)key2;
+/* Checks the sectors in mask if the verify mode calls for it on this hit. */
+static ULONG VerifyCacheHit(struct BlockCache *bc, struct BlockCacheNode *bcn, ULONG mask) {
+	switch (bc->verify_mode) {
 
-	if (sector1 > sector2)
-		return 1;
-	else if (sector1 < sector2)
-		return -1;
-	else
-		return 0;
+		case DIOCV_ALWAYS:
+			return VerifySectors(bc, bcn, mask);
+
+		case DIOCV_SAMPLED:
+			if (++bc->verify_count < bc->verify_period)
+				break;
+			bc->verify_count = 0;
+			return VerifySectors(bc, bcn, mask);
+
+		case DIOCV_SCRUB:
+			/* The whole page is checked once per memory handler run. */
+			if (bcn->verify_gen == bc->verify_gen)
+				break;
+			bcn->verify_gen = bc->verify_gen;
+			return VerifySectors(bc, bcn, bcn->valid_mask);
+
+	}
+
+	return 0;
 }
 
-static void InsertSector(struct Splay **root, struct BlockCacheNode *bcn) {
-	InsertSplay(root, CacheTreeCompareFunc, &bcn->splay, &bcn->sector);
+static inline ULONG HashPage(const struct BlockCache *bc, UQUAD page) {
+	return ((ULONG)page ^ (ULONG)(page >> 32)) & bc->hash_mask;
 }
 
-static struct BlockCacheNode *FindSector(struct Splay **root, UQUAD sector) {
-	struct Splay *sn;
+static void InsertPage(struct BlockCache *bc, struct BlockCacheNode *bcn) {
+	struct BlockCacheNode **head = &bc->hash_table[HashPage(bc, bcn->page)];
 
-	sn = FindSplay(root, CacheTreeCompareFunc, &sector);
+	bcn->hash_next  = *head;
+	bcn->hash_pprev = head;
+	if (*head != NULL)
+		(*head)->hash_pprev = &bcn->hash_next;
+	*head = bcn;
+}
 
-	return (sn != NULL) ? BCNFROMSPLAY(sn) : NULL;
+static void RemovePage(struct BlockCacheNode *bcn) {
+	*bcn->hash_pprev = bcn->hash_next;
+	if (bcn->hash_next != NULL)
+		bcn->hash_next->hash_pprev = bcn->hash_pprev;
+}
+
+static struct BlockCacheNode *FindPage(const struct BlockCache *bc, UQUAD page) {
+	struct BlockCacheNode *bcn;
+
+	for (bcn = bc->hash_table[HashPage(bc, page)]; bcn != NULL; bcn = bcn->hash_next) {
+		if (bcn->page == page)
+			return bcn;
+	}
+
+	return NULL;
+}
+
+/* Returns the block range that contains a dirty page, if any. */
+static struct BlockRangeNode *FindDirtyRange(const struct BlockCache *bc, UQUAD page) {
+	struct BlockCacheNode *bcn;
+
+	bcn = FindPage(bc, page);
+	if (bcn != NULL && bcn->type == BCN_DIRTY)
+		return bcn->range_node;
+
+	return NULL;
 }
 
 void ExpungeCacheNode(struct BlockCache *bc, struct BlockCacheNode *bcn) {
 	if (bcn != NULL) {
 		Remove((struct Node *)&bcn->node);
-		RemoveSplay(&bc->cache_tree, &bcn->splay);
+		RemovePage(bcn);
 
 		switch (bcn->type) {
 
@@ -187,10 +365,18 @@ void ExpungeCacheNode(struct BlockCache *bc, struct BlockCacheNode *bcn) {
 				bc->num_dirty_nodes--;
 				break;
 
+			case BCN_PINNED:
+				bc->num_pinned_nodes--;
+				break;
+
+			case BCN_STREAM:
+				bc->num_stream_nodes--;
+				break;
+
 		}
 		bc->num_cache_nodes--;
 
-		FreePooled(bc->mempool, bcn->data, bc->sector_size);
+		FreePooled(bc->mempool, bcn->data, PageAllocSize(bc));
 		FreePooled(bc->mempool, bcn, sizeof(struct BlockCacheNode));
 	}
 }
@@ -210,57 +396,88 @@ static void MoveMinList(struct MinList *dst, struct MinList *src) {
 	}
 }
 
-static int RangeTreeNeighborFunc(CONST_APTR key1, CONST_APTR key2) {
-	UQUAD sector = *(const UQUAD *)key1;
-	const struct BlockRange *range = key2;
-	UQUAD first = range->first;
-	UQUAD last  = range->last;
+/* Returns the position of the first block range that starts after page. */
+static ULONG FindRangeIndex(const struct BlockCache *bc, UQUAD page) {
+	ULONG low = 0;
+	ULONG high = bc->num_ranges;
+	ULONG middle;
 
-	if (first > 0) first--;
-	if (last < UINT64_MAX) last++;
+	while (low < high) {
+		middle = (low + high) >> 1;
+		if (bc->range_index[middle]->range.first <= page)
+			low = middle + 1;
+		else
+			high = middle;
+	}
 
-	if (sector > last)
-		return 1;
-	else if (sector < first)
-		return -1;
-	else
-		return 0;
+	return low;
 }
 
-static int RangeTreeCompareFunc(CONST_APTR key1, CONST_APTR key2) {
-	const struct BlockRange *range1 = key1;
-	const struct BlockRange *range2 = key2;
+static BOOL IndexBlockRange(struct BlockCache *bc, struct BlockRangeNode *brn) {
+	ULONG i;
 
-	if (range1->first > range2->last)
-		return 1;
-	else if (range1->last < range2->first)
-		return -1;
-	else
-		return 0;
+	if (bc->num_ranges == bc->max_ranges)
+		return FALSE;
+
+	i = FindRangeIndex(bc, brn->range.first);
+	memmove(&bc->range_index[i + 1], &bc->range_index[i], (bc->num_ranges - i) * sizeof(struct BlockRangeNode *));
+	bc->range_index[i] = brn;
+	bc->num_ranges++;
+
+	return TRUE;
 }
 
-static struct BlockRangeNode *GetBlockRange(struct BlockCache *bc, UQUAD sector) {
-	struct Splay *sn;
+static void UnindexBlockRange(struct BlockCache *bc, struct BlockRangeNode *brn) {
+	ULONG i;
+
+	/* The range may have been emptied, but it still sorts where it was. */
+	i = FindRangeIndex(bc, brn->range.first);
+	while (bc->range_index[--i] != brn);
+
+	bc->num_ranges--;
+	memmove(&bc->range_index[i], &bc->range_index[i + 1], (bc->num_ranges - i) * sizeof(struct BlockRangeNode *));
+}
+
+/* Dirty ranges are timestamped in seconds for DIO_WriteBackIOCache(). */
+static ULONG GetSeconds(void) {
+	struct DateStamp ds;
+
+	DateStamp(&ds);
+
+	return ((ULONG)ds.ds_Days * 24 * 60 + ds.ds_Minute) * 60 + ds.ds_Tick / TICKS_PER_SECOND;
+}
+
+static struct BlockRangeNode *GetBlockRange(struct BlockCache *bc, UQUAD page) {
 	struct BlockRangeNode *brn;
 
-	sn = FindSplay(&bc->range_tree, RangeTreeNeighborFunc, &sector);
-	if (sn != NULL) {
-		brn = BRNFROMSPLAY(sn);
-		if (sector < brn->range.first)
-			brn->range.first = sector;
-		else
-			brn->range.last = sector;
-	} else {
-		brn = AllocPooled(bc->mempool, sizeof(struct BlockRangeNode));
-		if (brn != NULL) {
-			brn->range.first = sector;
-			brn->range.last  = sector;
+	/* Extend a neighbouring range if there is one. */
+	brn = (page > 0) ? FindDirtyRange(bc, page - 1) : NULL;
+	if (brn != NULL) {
+		brn->range.last = page;
+		return brn;
+	}
 
-			NEWMINLIST(&brn->list);
+	brn = FindDirtyRange(bc, page + 1);
+	if (brn != NULL) {
+		brn->range.first = page;
+		return brn;
+	}
+
+	brn = AllocPooled(bc->mempool, sizeof(struct BlockRangeNode));
+	if (brn != NULL) {
+		brn->range.first = page;
+		brn->range.last  = page;
+		brn->dirty_time  = GetSeconds();
+		brn->flush       = FALSE;
+
+		NEWMINLIST(&brn->list);
 
-			InsertSplay(&bc->range_tree, RangeTreeCompareFunc, &brn->splay, &brn->range);
-			AddHead((struct List *)&bc->dirty_list, (struct Node *)&brn->node);
+		if (!IndexBlockRange(bc, brn)) {
+			FreePooled(bc->mempool, brn, sizeof(struct BlockRangeNode));
+			return NULL;
 		}
+
+		AddHead((struct List *)&bc->dirty_list, (struct Node *)&brn->node);
 	}
 
 	return brn;
@@ -269,7 +486,7 @@ static struct BlockRangeNode *GetBlockRange(struct BlockCache *bc, UQUAD sector)
 static void ExpungeBlockRange(struct BlockCache *bc, struct BlockRangeNode *brn) {
 	if (brn != NULL) {
 		Remove((struct Node *)&brn->node);
-		RemoveSplay(&bc->range_tree, &brn->splay);
+		UnindexBlockRange(bc, brn);
 
 		FreePooled(bc->mempool, brn, sizeof(struct BlockRangeNode));
 	}
@@ -280,6 +497,7 @@ static struct BlockRangeNode *MergeBlockRanges(struct BlockCache *bc, struct Blo
 	struct BlockCacheNode *bcn;
 
 	brn1->range.last = brn2->range.last;
+	brn1->dirty_time = MIN(brn1->dirty_time, brn2->dirty_time);
 
 	/* Need to update the range_node pointers. */
 	for (node = brn2->list.mlh_Head; (succ = node->mln_Succ) != NULL; node = succ) {
@@ -295,68 +513,229 @@ static struct BlockRangeNode *MergeBlockRanges(struct BlockCache *bc, struct Blo
 }
 
 static struct BlockRangeNode *AddToBlockRange(struct BlockCache *bc, struct BlockRangeNode *brn, struct BlockCacheNode *bcn) {
-	struct Splay *sn;
 	struct BlockRangeNode *brn2;
 
-	if (bcn->sector == brn->range.first) {
+	if (bcn->page == brn->range.first) {
 		AddHead((struct List *)&brn->list, (struct Node *)&bcn->node);
 
-		sn = PrevSplay(&brn->splay);
-		if (sn != NULL) {
-			brn2 = BRNFROMSPLAY(sn);
-			if ((brn2->range.last + 1) == brn->range.first)
-				brn = MergeBlockRanges(bc, brn2, brn);
-		}
+		brn2 = (bcn->page > 0) ? FindDirtyRange(bc, bcn->page - 1) : NULL;
+		if (brn2 != NULL && brn2 != brn)
+			brn = MergeBlockRanges(bc, brn2, brn);
 	} else {
 		AddTail((struct List *)&brn->list, (struct Node *)&bcn->node);
 
-		sn = NextSplay(&brn->splay);
-		if (sn != NULL) {
-			brn2 = BRNFROMSPLAY(sn);
-			if ((brn->range.last + 1) == brn2->range.first)
-				brn = MergeBlockRanges(bc, brn, brn2);
-		}
+		brn2 = FindDirtyRange(bc, bcn->page + 1);
+		if (brn2 != NULL && brn2 != brn)
+			brn = MergeBlockRanges(bc, brn, brn2);
 	}
 
 	return brn;
 }
 
-static struct BlockCacheNode *AddSector(struct BlockCache *bc, UQUAD sector, BOOL dirty) {
-	struct BlockCacheNode *bcn;
-	struct BlockRangeNode *brn = NULL;
-	APTR data;
+static struct GhostNode *FindGhost(const struct BlockCache *bc, UQUAD page) {
+	struct GhostNode *gn;
 
-	bcn = AllocPooled(bc->mempool, sizeof(struct BlockCacheNode));
-	data = AllocPooled(bc->mempool, bc->sector_size);
-	if (bcn != NULL && data != NULL) {
-		if (dirty) brn = GetBlockRange(bc, sector);
+	for (gn = bc->ghost_table[HashPage(bc, page)]; gn != NULL; gn = gn->hash_next) {
+		if (gn->page == page)
+			return gn;
+	}
 
-		if (dirty == FALSE || brn != NULL) {
-			bcn->sector     = sector;
-			bcn->data       = data;
-			bcn->range_node = NULL;
-			bcn->checksum   = (ULONG)-1;
+	return NULL;
+}
 
-			if (dirty == FALSE) {
-				bcn->type = BCN_PROBATION;
-				AddHead((struct List *)&bc->probation_list, (struct Node *)&bcn->node);
-			} else {
-				bcn->type       = BCN_DIRTY;
-				bcn->range_node = AddToBlockRange(bc, brn, bcn);
-				bc->num_dirty_nodes++;
-			}
+static void ExpungeGhost(struct BlockCache *bc, struct GhostNode *gn) {
+	if (gn != NULL) {
+		Remove((struct Node *)&gn->node);
 
-			InsertSector(&bc->cache_tree, bcn);
-			bc->num_cache_nodes++;
+		*gn->hash_pprev = gn->hash_next;
+		if (gn->hash_next != NULL)
+			gn->hash_next->hash_pprev = gn->hash_pprev;
 
-			if (bc->num_cache_nodes > bc->max_cache_nodes)
-				ExpungeCacheNode(bc, BCNFROMNODE(bc->probation_list.mlh_TailPred));
+		if (gn->type == BCN_PROBATION)
+			bc->num_recent_ghosts--;
+		else
+			bc->num_frequent_ghosts--;
 
-			return bcn;
+		FreePooled(bc->mempool, gn, sizeof(struct GhostNode));
+	}
+}
+
+/* Evicts a clean page and remembers it in the ghost list matching its type. */
+static void EvictPage(struct BlockCache *bc, struct BlockCacheNode *bcn) {
+	struct GhostNode *gn, **head;
+
+	gn = AllocPooled(bc->mempool, sizeof(struct GhostNode));
+	if (gn != NULL) {
+		gn->page = bcn->page;
+		gn->type = bcn->type;
+
+		head = &bc->ghost_table[HashPage(bc, gn->page)];
+		gn->hash_next  = *head;
+		gn->hash_pprev = head;
+		if (*head != NULL)
+			(*head)->hash_pprev = &gn->hash_next;
+		*head = gn;
+
+		if (gn->type == BCN_PROBATION) {
+			AddHead((struct List *)&bc->recent_ghost_list, (struct Node *)&gn->node);
+			bc->num_recent_ghosts++;
+		} else {
+			AddHead((struct List *)&bc->frequent_ghost_list, (struct Node *)&gn->node);
+			bc->num_frequent_ghosts++;
+		}
+	}
+
+	ExpungeCacheNode(bc, bcn);
+}
+
+/* ARC's REPLACE: evicts from the recent list while it is above its target size. */
+static void ReplacePage(struct BlockCache *bc, BOOL frequent_ghost_hit) {
+	ULONG recent = bc->num_cache_nodes - bc->num_protected_nodes - bc->num_dirty_nodes - bc->num_pinned_nodes -
+		bc->num_stream_nodes;
+
+	if (bc->num_cache_nodes < bc->max_cache_nodes)
+		return;
+
+	if (recent > 0 && (recent > bc->arc_target || (frequent_ghost_hit && recent == bc->arc_target)))
+		EvictPage(bc, BCNFROMNODE(bc->probation_list.mlh_TailPred));
+	else if (bc->num_protected_nodes > 0)
+		EvictPage(bc, BCNFROMNODE(bc->protected_list.mlh_TailPred));
+	else if (recent > 0)
+		EvictPage(bc, BCNFROMNODE(bc->probation_list.mlh_TailPred));
+	else if (bc->num_stream_nodes > 0)
+		ExpungeCacheNode(bc, BCNFROMNODE(bc->stream_list.mlh_TailPred));
+}
+
+/*
+ * Makes room for a new page according to ARC and returns the list it goes on.
+ * The probation and protected lists take the roles of T1 and T2, and
+ * arc_target is the adaptive target size of T1.
+ */
+static UBYTE AdaptReplacement(struct BlockCache *bc, UQUAD page) {
+	ULONG c = bc->max_cache_nodes;
+	ULONG recent = bc->num_cache_nodes - bc->num_protected_nodes - bc->num_dirty_nodes - bc->num_pinned_nodes -
+		bc->num_stream_nodes;
+	ULONG delta;
+	struct GhostNode *gn;
+
+	gn = FindGhost(bc, page);
+	if (gn != NULL) {
+		if (gn->type == BCN_PROBATION) {
+			/* Recently evicted, so T1 should have been larger */
+			delta = MAX(bc->num_frequent_ghosts / bc->num_recent_ghosts, 1);
+			bc->arc_target = MIN(bc->arc_target + delta, c);
+			ExpungeGhost(bc, gn);
+			ReplacePage(bc, FALSE);
+		} else {
+			delta = MAX(bc->num_recent_ghosts / bc->num_frequent_ghosts, 1);
+			bc->arc_target = (bc->arc_target > delta) ? (bc->arc_target - delta) : 0;
+			ExpungeGhost(bc, gn);
+			ReplacePage(bc, TRUE);
+		}
+
+		return BCN_PROTECTED;
+	}
+
+	if ((recent + bc->num_recent_ghosts) >= c) {
+		if (recent < c) {
+			ExpungeGhost(bc, GNFROMNODE(bc->recent_ghost_list.mlh_TailPred));
+			ReplacePage(bc, FALSE);
+		} else {
+			ExpungeCacheNode(bc, BCNFROMNODE(bc->probation_list.mlh_TailPred));
+		}
+	} else if ((recent + bc->num_protected_nodes + bc->num_recent_ghosts + bc->num_frequent_ghosts) >= c) {
+		if ((recent + bc->num_protected_nodes + bc->num_recent_ghosts + bc->num_frequent_ghosts) >= 2 * c &&
+			bc->num_frequent_ghosts > 0)
+		{
+			ExpungeGhost(bc, GNFROMNODE(bc->frequent_ghost_list.mlh_TailPred));
+		}
+		ReplacePage(bc, FALSE);
+	}
+
+	return BCN_PROBATION;
+}
+
+/* Links a clean page on the list that matches its hint. */
+static void AddCleanPage(struct BlockCache *bc, struct BlockCacheNode *bcn) {
+	if (bcn->hint == DIOCH_DATA) {
+		bcn->type = BCN_STREAM;
+		AddHead((struct List *)&bc->stream_list, (struct Node *)&bcn->node);
+		bc->num_stream_nodes++;
+	} else {
+		bcn->type = BCN_PROBATION;
+		AddHead((struct List *)&bc->probation_list, (struct Node *)&bcn->node);
+	}
+}
+
+/* Links a clean page in the protected segment, whose LRU page may have to go back on probation. */
+static void ProtectPage(struct BlockCache *bc, struct BlockCacheNode *bcn) {
+	bcn->type = BCN_PROTECTED;
+	AddHead((struct List *)&bc->protected_list, (struct Node *)&bcn->node);
+	bc->num_protected_nodes++;
+
+	if (bc->num_protected_nodes > bc->max_protected_nodes) {
+		bcn = BCNFROMNODE(bc->protected_list.mlh_TailPred);
+		Remove((struct Node *)&bcn->node);
+		bc->num_protected_nodes--;
+
+		bcn->type = BCN_PROBATION;
+		AddHead((struct List *)&bc->probation_list, (struct Node *)&bcn->node);
+	}
+}
+
+static struct BlockCacheNode *AddPage(struct BlockCache *bc, UQUAD page) {
+	struct BlockCacheNode *bcn;
+	APTR data;
+
+	bcn = AllocPooled(bc->mempool, sizeof(struct BlockCacheNode));
+	data = AllocPooled(bc->mempool, PageAllocSize(bc));
+	if (bcn != NULL && data != NULL) {
+		bcn->page       = page;
+		bcn->data       = data;
+		bcn->range_node = NULL;
+		bcn->valid_mask = 0;
+		bcn->dirty_mask = 0;
+		bcn->checksums  = data + bc->page_size;
+		bcn->verify_gen = bc->verify_gen;
+		bcn->type       = BCN_PROBATION;
+		bcn->hint       = bc->cache_hint;
+		bcn->pin_count  = 0;
+
+		/* Written data that was flushed comes back clean and may overrun its share. */
+		while (bc->num_stream_nodes > bc->max_stream_nodes)
+			ExpungeCacheNode(bc, BCNFROMNODE(bc->stream_list.mlh_TailPred));
+
+		/*
+		 * Make room before the new page is linked in, so it can't be the victim.
+		 * Data pages replace each other once their share is used up.
+		 */
+		if (bcn->hint == DIOCH_DATA && bc->num_stream_nodes == bc->max_stream_nodes)
+			ExpungeCacheNode(bc, BCNFROMNODE(bc->stream_list.mlh_TailPred));
+		else if (bc->cache_policy == DIOCP_ARC)
+			bcn->type = AdaptReplacement(bc, page);
+		else if (bc->num_cache_nodes >= bc->max_cache_nodes && !IsMinListEmpty(&bc->probation_list))
+			ExpungeCacheNode(bc, BCNFROMNODE(bc->probation_list.mlh_TailPred));
+		else if (bc->num_cache_nodes >= bc->max_cache_nodes && !IsMinListEmpty(&bc->stream_list))
+			ExpungeCacheNode(bc, BCNFROMNODE(bc->stream_list.mlh_TailPred));
+
+		if (bcn->hint == DIOCH_DATA) {
+			AddCleanPage(bc, bcn);
+		} else if (bcn->type == BCN_PROTECTED) {
+			AddHead((struct List *)&bc->protected_list, (struct Node *)&bcn->node);
+			bc->num_protected_nodes++;
+		} else if (bcn->hint == DIOCH_METADATA) {
+			ProtectPage(bc, bcn);
+		} else {
+			AddCleanPage(bc, bcn);
 		}
+
+		InsertPage(bc, bcn);
+		bc->num_cache_nodes++;
+
+		return bcn;
 	}
 
-	if (data != NULL) FreePooled(bc->mempool, data, bc->sector_size);
+	if (data != NULL) FreePooled(bc->mempool, data, PageAllocSize(bc));
 	if (bcn != NULL) FreePooled(bc->mempool, bcn, sizeof(struct BlockCacheNode));
 
 	return NULL;
@@ -370,17 +749,23 @@ static void CacheHit(struct BlockCache *bc, struct BlockCacheNode *bcn) {
 		case BCN_PROBATION:
 			Remove((struct Node *)&bcn->node);
 
-			bcn->type = BCN_PROTECTED;
-			AddHead((struct List *)&bc->protected_list, (struct Node *)&bcn->node);
-			bc->num_protected_nodes++;
+			/* A hit by a data read doesn't earn the page protection. */
+			if (bc->cache_hint == DIOCH_DATA)
+				AddHead((struct List *)&bc->probation_list, (struct Node *)&bcn->node);
+			else
+				ProtectPage(bc, bcn);
+			break;
 
-			if (bc->num_protected_nodes > bc->max_protected_nodes) {
-				bcn = BCNFROMNODE(bc->protected_list.mlh_TailPred);
-				Remove((struct Node *)&bcn->node);
-				bc->num_protected_nodes--;
+		case BCN_STREAM:
+			Remove((struct Node *)&bcn->node);
 
-				bcn->type = BCN_PROBATION;
-				AddHead((struct List *)&bc->probation_list, (struct Node *)&bcn->node);
+			/* Metadata that was read as data before is moved over. */
+			if (bc->cache_hint == DIOCH_METADATA) {
+				bc->num_stream_nodes--;
+				bcn->hint = DIOCH_METADATA;
+				ProtectPage(bc, bcn);
+			} else {
+				AddHead((struct List *)&bc->stream_list, (struct Node *)&bcn->node);
 			}
 			break;
 
@@ -409,10 +794,18 @@ static struct BlockRangeNode *SplitBlockRange(struct BlockCache *bc, struct Bloc
 
 	brn2 = AllocPooled(bc->mempool, sizeof(struct BlockRangeNode));
 	if (brn2 != NULL) {
-		brn1->range.last  = bcn->sector;
-
-		brn2->range.first = bcn->sector + 1;
+		brn2->range.first = bcn->page + 1;
 		brn2->range.last  = brn1->range.last;
+		brn2->dirty_time  = brn1->dirty_time;
+		brn2->flush       = brn1->flush;
+
+		if (!IndexBlockRange(bc, brn2)) {
+			FreePooled(bc->mempool, brn2, sizeof(struct BlockRangeNode));
+			return NULL;
+		}
+
+		/* The split page is removed from the list by the caller. */
+		brn1->range.last = bcn->page - 1;
 
 		NEWMINLIST(&brn2->list);
 
@@ -432,23 +825,30 @@ static struct BlockRangeNode *SplitBlockRange(struct BlockCache *bc, struct Bloc
 		brn1->list.mlh_TailPred = &bcn->node;
 		bcn->node.mln_Succ = (struct MinNode *)&brn1->list.mlh_Tail;
 
-		InsertSplay(&bc->range_tree, RangeTreeCompareFunc, &brn2->splay, &brn2->range);
 		Insert((struct List *)&bc->dirty_list, (struct Node *)&brn2->node, (struct Node *)&brn1->node);
 	}
 
 	return brn2;
 }
 
-static BOOL ClearDirty(struct BlockCache *bc, struct BlockCacheNode *bcn) {
+/* Clears the dirty bits in mask, the page leaves its range when none are left. */
+static BOOL ClearDirty(struct BlockCache *bc, struct BlockCacheNode *bcn, ULONG mask) {
 	struct BlockRangeNode *brn;
 
-	if (bcn->type != BCN_DIRTY)
+	mask &= bcn->dirty_mask;
+	if (mask == 0)
 		return FALSE;
 
+	if ((bcn->dirty_mask & ~mask) != 0) {
+		bcn->dirty_mask &= ~mask;
+		UpdateChecksums(bc, bcn, mask);
+		return TRUE;
+	}
+
 	brn = bcn->range_node;
-	if (bcn->sector == brn->range.first)
+	if (bcn->page == brn->range.first)
 		brn->range.first++;
-	else if (bcn->sector == brn->range.last)
+	else if (bcn->page == brn->range.last)
 		brn->range.last--;
 	else if (!SplitBlockRange(bc, brn, bcn))
 		return FALSE;
@@ -456,10 +856,18 @@ static BOOL ClearDirty(struct BlockCache *bc, struct BlockCacheNode *bcn) {
 	Remove((struct Node *)&bcn->node);
 	bc->num_dirty_nodes--;
 
-	bcn->type     = BCN_PROBATION;
-	bcn->checksum = BlockChecksum(bcn->data, bc->sector_size);
+	bcn->range_node = NULL;
+	bcn->dirty_mask = 0;
+
+	UpdateChecksums(bc, bcn, mask);
 
-	AddHead((struct List *)&bc->probation_list, (struct Node *)&bcn->node);
+	if (bcn->pin_count > 0) {
+		bcn->type = BCN_PINNED;
+		AddHead((struct List *)&bc->pinned_list, (struct Node *)&bcn->node);
+		bc->num_pinned_nodes++;
+	} else {
+		AddCleanPage(bc, bcn);
+	}
 
 	/* Remove block range if empty. */
 	if (IsMinListEmpty(&brn->list))
@@ -468,13 +876,16 @@ static BOOL ClearDirty(struct BlockCache *bc, struct BlockCacheNode *bcn) {
 	return TRUE;
 }
 
-static BOOL SetDirty(struct BlockCache *bc, struct BlockCacheNode *bcn) {
+/* Sets the dirty bits in mask, the page joins a range when it was clean. */
+static BOOL SetDirty(struct BlockCache *bc, struct BlockCacheNode *bcn, ULONG mask) {
 	struct BlockRangeNode *brn;
 
-	if (bcn->type == BCN_DIRTY)
-		return FALSE;
+	if (bcn->type == BCN_DIRTY) {
+		bcn->dirty_mask |= mask;
+		return TRUE;
+	}
 
-	brn = GetBlockRange(bc, bcn->sector);
+	brn = GetBlockRange(bc, bcn->page);
 	if (brn == NULL)
 		return FALSE;
 
@@ -488,10 +899,18 @@ static BOOL SetDirty(struct BlockCache *bc, struct BlockCacheNode *bcn) {
 			bc->num_protected_nodes--;
 			break;
 
+		case BCN_PINNED:
+			bc->num_pinned_nodes--;
+			break;
+
+		case BCN_STREAM:
+			bc->num_stream_nodes--;
+			break;
+
 	}
 
-	bcn->type     = BCN_DIRTY;
-	bcn->checksum = (ULONG)-1;
+	bcn->type       = BCN_DIRTY;
+	bcn->dirty_mask = mask;
 
 	bcn->range_node = AddToBlockRange(bc, brn, bcn);
 	bc->num_dirty_nodes++;
@@ -499,35 +918,98 @@ static BOOL SetDirty(struct BlockCache *bc, struct BlockCacheNode *bcn) {
 	return TRUE;
 }
 
-BOOL ReadCacheNode(struct BlockCache *bc, UQUAD sector, APTR buffer, ULONG flags) {
+BOOL ProbeCacheNode(struct BlockCache *bc, UQUAD sector) {
 	struct BlockCacheNode *bcn;
 	BOOL result = FALSE;
 
-	DEBUGF("ReadCacheNode(%#p, %llu, %#p, 0x%08x)\n", bc, sector, buffer, flags);
+	bc->cache_busy = TRUE;
+
+	/* Only looks the sector up, the LRU order is left as it is. */
+	bcn = FindPage(bc, sector >> bc->page_shift);
+	if (bcn != NULL && (bcn->valid_mask & (1UL << ((ULONG)sector & (bc->page_sectors - 1)))) != 0)
+		result = TRUE;
+
+	bc->cache_busy = FALSE;
+
+	return result;
+}
+
+ULONG ReadCacheNode(struct BlockCache *bc, UQUAD sector, APTR buffer, ULONG count, ULONG flags) {
+	struct BlockCacheNode *bcn;
+	ULONG index, mask, bad;
+	ULONG sectors = 0;
+
+	DEBUGF("ReadCacheNode(%#p, %llu, %#p, %u, 0x%08x)\n", bc, sector, buffer, count, flags);
 
 	bc->cache_busy = TRUE;
 
-	bcn = FindSector(&bc->cache_tree, sector);
+	bcn = FindPage(bc, sector >> bc->page_shift);
 	if (bcn != NULL) {
-		if (bcn->type == BCN_DIRTY) {
-			result = TRUE;
+		index = (ULONG)sector & (bc->page_sectors - 1);
+		count = PageSectors(bc, sector, count);
+		mask  = ((flags & RCN_DIRTY_ONLY) != 0) ? bcn->dirty_mask : bcn->valid_mask;
+
+		while (sectors < count && (mask & (1UL << (index + sectors))) != 0)
+			sectors++;
+
+		/* Only the sectors in front of a corrupted one can be used. */
+		if (sectors > 0 && (bad = VerifyCacheHit(bc, bcn, SectorBits(index, sectors))) != 0) {
+			mask &= ~bad;
+			sectors = 0;
+			while (sectors < count && (mask & (1UL << (index + sectors))) != 0)
+				sectors++;
+		}
 
+		if (sectors > 0) {
 			if (buffer != NULL)
-				CopyMem(bcn->data, buffer, bc->sector_size);
+				CopyMem(bcn->data + (index << bc->sector_shift), buffer, sectors << bc->sector_shift);
 
 			CacheHit(bc, bcn);
-		} else if ((flags & RCN_DIRTY_ONLY) == 0) {
-			if (BlockChecksum(bcn->data, bc->sector_size) == bcn->checksum) {
-				result = TRUE;
+		}
+	}
 
-				if (buffer != NULL)
-					CopyMem(bcn->data, buffer, bc->sector_size);
+	bc->cache_busy = FALSE;
 
-				CacheHit(bc, bcn);
-			} else {
-				/* Throw away corrupted cache data */
-				ExpungeCacheNode(bc, bcn);
-			}
+	return sectors;
+}
+
+BOOL LoadCacheNode(struct BlockCache *bc, UQUAD sector, APTR buffer, ULONG count) {
+	struct BlockCacheNode *bcn;
+	UQUAD page = sector >> bc->page_shift;
+	ULONG index, sectors;
+	BOOL result = FALSE;
+
+	DEBUGF("LoadCacheNode(%#p, %llu, %#p, %u)\n", bc, sector, buffer, count);
+
+	index = (ULONG)sector & (bc->page_sectors - 1);
+	if (count == 0 || (index + count) > bc->page_sectors)
+		return FALSE;
+
+	/* The last page of the disk may be short */
+	sectors = bc->page_sectors;
+	if (((page + 1) << bc->page_shift) > bc->dio_handle->total_sectors)
+		sectors = bc->dio_handle->total_sectors - (page << bc->page_shift);
+
+	bc->cache_busy = TRUE;
+
+	bcn = FindPage(bc, page);
+	if (bcn == NULL)
+		bcn = AddPage(bc, page);
+
+	/* Dirty sectors must not be overwritten, those pages are filled a run at a time. */
+	if (bcn != NULL && bcn->type != BCN_DIRTY) {
+		if (DeviceReadBlocks(bc->dio_handle, page << bc->page_shift, bcn->data, sectors) == DIO_SUCCESS) {
+			result = TRUE;
+
+			bcn->valid_mask = SectorBits(0, sectors);
+			bcn->verify_gen = bc->verify_gen;
+			UpdateChecksums(bc, bcn, bcn->valid_mask);
+
+			CopyMem(bcn->data + (index << bc->sector_shift), buffer, count << bc->sector_shift);
+		} else if (bcn->pin_count > 0) {
+			bcn->valid_mask = 0;
+		} else {
+			ExpungeCacheNode(bc, bcn);
 		}
 	}
 
@@ -536,37 +1018,185 @@ BOOL ReadCacheNode(struct BlockCache *bc, UQUAD sector, APTR buffer, ULONG flags
 	return result;
 }
 
-BOOL StoreCacheNode(struct BlockCache *bc, UQUAD sector, CONST_APTR buffer, ULONG flags) {
+/*
+ * Pins the page holding count sectors from sector and returns a pointer to
+ * their cached data, which stays valid until UnpinCacheNode(). Returns NULL
+ * if the sectors are not all cached or too many pages are pinned already.
+ */
+APTR PinCacheNode(struct BlockCache *bc, UQUAD sector, ULONG count) {
 	struct BlockCacheNode *bcn;
-	BOOL result = FALSE;
+	ULONG index, mask, slot;
+	APTR data = NULL;
+
+	DEBUGF("PinCacheNode(%#p, %llu, %u)\n", bc, sector, count);
 
-	DEBUGF("StoreCacheNode(%#p, %llu, %#p, 0x%08x)\n", bc, sector, buffer, flags);
+	index = (ULONG)sector & (bc->page_sectors - 1);
+	if (count == 0 || (index + count) > bc->page_sectors)
+		return NULL;
 
 	bc->cache_busy = TRUE;
 
-	bcn = FindSector(&bc->cache_tree, sector);
+	bcn = FindPage(bc, sector >> bc->page_shift);
 	if (bcn != NULL) {
-		result = TRUE;
+		mask = SectorBits(index, count);
+
+		/* A page that isn't pinned yet needs a free slot. */
+		for (slot = 0; slot < MAX_PINNED_PAGES; slot++) {
+			if (bc->pinned_pages[slot] == bcn || (bcn->pin_count == 0 && bc->pinned_pages[slot] == NULL))
+				break;
+		}
 
-		CopyMem((APTR)buffer, bcn->data, bc->sector_size);
+		if (slot < MAX_PINNED_PAGES && (bcn->valid_mask & mask) == mask &&
+			(VerifyCacheHit(bc, bcn, mask) & mask) == 0)
+		{
+			CacheHit(bc, bcn);
 
-		if (bcn->type != BCN_DIRTY)
-			bcn->checksum = BlockChecksum(bcn->data, bc->sector_size);
-		else if ((flags & SCN_CLEAR_DIRTY) != 0)
-			ClearDirty(bc, bcn);
+			if (bcn->pin_count++ == 0) {
+				bc->pinned_pages[slot] = bcn;
+
+				/* Dirty pages are never evicted, so they can stay in their range. */
+				if (bcn->type != BCN_DIRTY) {
+					Remove((struct Node *)&bcn->node);
+					if (bcn->type == BCN_PROTECTED)
+						bc->num_protected_nodes--;
+					else if (bcn->type == BCN_STREAM)
+						bc->num_stream_nodes--;
+
+					bcn->type = BCN_PINNED;
+					AddHead((struct List *)&bc->pinned_list, (struct Node *)&bcn->node);
+					bc->num_pinned_nodes++;
+				}
+			}
 
-		CacheHit(bc, bcn);
-	} else {
-		if ((flags & SCN_UPDATE_ONLY) == 0) {
-			bcn = AddSector(bc, sector, FALSE);
-			if (bcn != NULL) {
-				result = TRUE;
+			data = bcn->data + (index << bc->sector_shift);
+		}
+	}
+
+	bc->cache_busy = FALSE;
+
+	return data;
+}
+
+void UnpinCacheNode(struct BlockCache *bc, CONST_APTR data) {
+	struct BlockCacheNode *bcn;
+	ULONG slot;
+
+	DEBUGF("UnpinCacheNode(%#p, %#p)\n", bc, data);
+
+	for (slot = 0; slot < MAX_PINNED_PAGES; slot++) {
+		bcn = bc->pinned_pages[slot];
+		if (bcn != NULL && data >= bcn->data && data < (bcn->data + bc->page_size))
+			break;
+	}
+
+	if (slot == MAX_PINNED_PAGES)
+		return;
+
+	bc->cache_busy = TRUE;
+
+	if (--bcn->pin_count == 0) {
+		bc->pinned_pages[slot] = NULL;
+
+		/* The page was used, so it counts as a hit on its way back. */
+		if (bcn->type == BCN_PINNED) {
+			Remove((struct Node *)&bcn->node);
+			bc->num_pinned_nodes--;
+
+			AddCleanPage(bc, bcn);
+			CacheHit(bc, bcn);
+		}
+	}
+
+	bc->cache_busy = FALSE;
+}
+
+void StoreCacheNode(struct BlockCache *bc, UQUAD sector, CONST_APTR buffer, ULONG count, ULONG flags) {
+	struct BlockCacheNode *bcn;
+	ULONG index, sectors, mask, i;
+	BOOL found;
+
+	DEBUGF("StoreCacheNode(%#p, %llu, %#p, %u, 0x%08x)\n", bc, sector, buffer, count, flags);
+
+	bc->cache_busy = TRUE;
+
+	while (count > 0) {
+		index   = (ULONG)sector & (bc->page_sectors - 1);
+		sectors = PageSectors(bc, sector, count);
+		mask    = SectorBits(index, sectors);
+
+		bcn = FindPage(bc, sector >> bc->page_shift);
+		found = (bcn != NULL) ? TRUE : FALSE;
+
+		if (bcn == NULL && (flags & SCN_UPDATE_ONLY) == 0)
+			bcn = AddPage(bc, sector >> bc->page_shift);
 
-				CopyMem((APTR)buffer, bcn->data, bc->sector_size);
+		if (bcn != NULL) {
+			/* Never overwrite newer data, unless it was just written out */
+			if ((flags & SCN_CLEAR_DIRTY) == 0)
+				mask &= ~bcn->dirty_mask;
 
-				bcn->checksum = BlockChecksum(bcn->data, bc->sector_size);
+			if (mask == SectorBits(index, sectors)) {
+				CopyMem((APTR)buffer, bcn->data + (index << bc->sector_shift), sectors << bc->sector_shift);
+			} else {
+				for (i = 0; i < sectors; i++) {
+					if ((mask & (1UL << (index + i))) != 0)
+						CopyMem((APTR)(buffer + (i << bc->sector_shift)), bcn->data + ((index + i) << bc->sector_shift), bc->sector_size);
+				}
 			}
+
+			bcn->valid_mask |= mask;
+			UpdateChecksums(bc, bcn, mask & ~bcn->dirty_mask);
+
+			if ((flags & SCN_CLEAR_DIRTY) != 0)
+				ClearDirty(bc, bcn, mask);
+
+			if (found)
+				CacheHit(bc, bcn);
+		}
+
+		sector += sectors;
+		buffer += sectors << bc->sector_shift;
+		count  -= sectors;
+	}
+
+	bc->cache_busy = FALSE;
+}
+
+ULONG WriteCacheNode(struct BlockCache *bc, UQUAD sector, CONST_APTR buffer, ULONG count, ULONG flags) {
+	struct BlockCacheNode *bcn;
+	ULONG index, sectors, mask;
+	ULONG result = 0;
+
+	DEBUGF("WriteCacheNode(%#p, %llu, %#p, %u, 0x%08x)\n", bc, sector, buffer, count, flags);
+
+	if (bc->write_cache_enabled == FALSE)
+		return 0;
+
+	bc->cache_busy = TRUE;
+
+	index   = (ULONG)sector & (bc->page_sectors - 1);
+	sectors = PageSectors(bc, sector, count);
+	mask    = SectorBits(index, sectors);
+
+	bcn = FindPage(bc, sector >> bc->page_shift);
+	if (bcn != NULL) {
+		if (bcn->type == BCN_DIRTY || bc->num_dirty_nodes < bc->max_dirty_nodes) {
+			if (SetDirty(bc, bcn, mask))
+				result = sectors;
 		}
+
+		CacheHit(bc, bcn);
+	} else {
+		if (bc->num_dirty_nodes < bc->max_dirty_nodes) {
+			bcn = AddPage(bc, sector >> bc->page_shift);
+			if (bcn != NULL && SetDirty(bc, bcn, mask))
+				result = sectors;
+		}
+	}
+
+	if (result != 0) {
+		CopyMem((APTR)buffer, bcn->data + (index << bc->sector_shift), sectors << bc->sector_shift);
+		bcn->valid_mask |= mask;
 	}
 
 	bc->cache_busy = FALSE;
@@ -574,116 +1204,321 @@ BOOL StoreCacheNode(struct BlockCache *bc, UQUAD sector, CONST_APTR buffer, ULON
 	return result;
 }
 
-BOOL WriteCacheNode(struct BlockCache *bc, UQUAD sector, CONST_APTR buffer, ULONG flags) {
+/*
+ * Copies bytes into a cached sector at offset and marks the sector dirty,
+ * so that small writes don't have to rewrite the whole sector. Returns
+ * FALSE if the sector isn't cached or can't be made dirty.
+ */
+BOOL PatchCacheNode(struct BlockCache *bc, UQUAD sector, ULONG offset, CONST_APTR buffer, ULONG bytes) {
 	struct BlockCacheNode *bcn;
+	ULONG index, mask;
 	BOOL result = FALSE;
 
-	DEBUGF("WriteCacheNode(%#p, %llu, %#p, 0x%08x)\n", bc, sector, buffer, flags);
+	DEBUGF("PatchCacheNode(%#p, %llu, %u, %#p, %u)\n", bc, sector, offset, buffer, bytes);
 
 	if (bc->write_cache_enabled == FALSE)
 		return FALSE;
 
 	bc->cache_busy = TRUE;
 
-	bcn = FindSector(&bc->cache_tree, sector);
-	if (bcn != NULL) {
-		if (bcn->type != BCN_DIRTY && bc->num_dirty_nodes < bc->max_dirty_nodes)
-			SetDirty(bc, bcn);
+	index = (ULONG)sector & (bc->page_sectors - 1);
+	mask  = 1UL << index;
 
-		if (bcn->type == BCN_DIRTY) {
+	/* The rest of the sector is written back as it is, so it must be good. */
+	bcn = FindPage(bc, sector >> bc->page_shift);
+	if (bcn != NULL && (bcn->valid_mask & mask) != 0 && (VerifyCacheHit(bc, bcn, mask) & mask) == 0) {
+		if ((bcn->dirty_mask & mask) != 0 ||
+			((bcn->type == BCN_DIRTY || bc->num_dirty_nodes < bc->max_dirty_nodes) && SetDirty(bc, bcn, mask)))
+		{
+			CopyMem((APTR)buffer, bcn->data + (index << bc->sector_shift) + offset, bytes);
 			result = TRUE;
-
-			CopyMem((APTR)buffer, bcn->data, bc->sector_size);
 		}
 
 		CacheHit(bc, bcn);
-	} else {
-		if (bc->num_dirty_nodes < bc->max_dirty_nodes) {
-			bcn = AddSector(bc, sector, TRUE);
-			if (bcn != NULL) {
-				result = TRUE;
+	}
 
-				CopyMem((APTR)buffer, bcn->data, bc->sector_size);
+	bc->cache_busy = FALSE;
 
-				bcn->checksum = (ULONG)-1;
-			}
-		}
+	return result;
+}
+
+/* Returns the write buffer that is used with request req of the ring. */
+static inline APTR WriteBuffer(const struct BlockCache *bc, ULONG req) {
+	return bc->write_buffer + ((req * bc->write_buffer_size) << bc->sector_shift);
+}
+
+/* Waits for a run of dirty sectors queued on request req and cleans it. */
+static BOOL FinishDirtySectors(struct BlockCache *bc, ULONG req, UQUAD sector, ULONG count) {
+	struct BlockCacheNode *bcn;
+	ULONG sectors;
+
+	if (DeviceWaitBlocks(bc->dio_handle, req) != DIO_SUCCESS)
+		return FALSE;
+
+	bc->cache_busy = TRUE;
+
+	/* Clean sectors that were merged into the run are left alone. */
+	while (count > 0) {
+		sectors = PageSectors(bc, sector, count);
+
+		bcn = FindPage(bc, sector >> bc->page_shift);
+		ClearDirty(bc, bcn, SectorBits((ULONG)sector & (bc->page_sectors - 1), sectors));
+
+		sector += sectors;
+		count  -= sectors;
 	}
 
 	bc->cache_busy = FALSE;
 
-	return result;
+	return TRUE;
 }
 
-BOOL FlushDirtyNodes(struct BlockCache *bc, ULONG max_dirty_nodes) {
-	struct MinNode *node, *pred, *succ;
+/*
+ * Copies the sectors between two dirty runs to the write buffer, so that the
+ * runs can be written with one request instead of two. This is only done if
+ * all of them are cached, clean and pass verification.
+ */
+static BOOL FillFlushGap(struct BlockCache *bc, UQUAD sector, ULONG count, APTR buffer) {
+	struct BlockCacheNode *bcn;
+	ULONG index, sectors, mask;
+
+	while (count > 0) {
+		index   = (ULONG)sector & (bc->page_sectors - 1);
+		sectors = PageSectors(bc, sector, count);
+		mask    = SectorBits(index, sectors);
+
+		bcn = FindPage(bc, sector >> bc->page_shift);
+		if (bcn == NULL || (bcn->valid_mask & mask) != mask || (bcn->dirty_mask & mask) != 0)
+			return FALSE;
+
+		if (bc->verify_mode != DIOCV_NEVER && VerifySectors(bc, bcn, mask) != 0)
+			return FALSE;
+
+		CopyMem(bcn->data + (index << bc->sector_shift), buffer, sectors << bc->sector_shift);
+
+		sector += sectors;
+		buffer += sectors << bc->sector_shift;
+		count  -= sectors;
+	}
+
+	return TRUE;
+}
+
+/* Returns the first block range that starts at or after page. */
+static struct BlockRangeNode *NextBlockRange(const struct BlockCache *bc, UQUAD page) {
+	ULONG i;
+
+	i = (page > 0) ? FindRangeIndex(bc, page - 1) : 0;
+
+	return (i < bc->num_ranges) ? bc->range_index[i] : NULL;
+}
+
+/*
+ * Writes the dirty ranges in ascending order, like an elevator, and runs
+ * that are close together as one. While a run is being written the next
+ * one is gathered in another write buffer. If marked_only is set only
+ * ranges with the flush flag are written. A max_writes of zero means no
+ * limit.
+ */
+static BOOL WriteBlockRanges(struct BlockCache *bc, BOOL marked_only, ULONG max_writes) {
+	struct MinNode *node, *succ;
 	struct BlockRangeNode *brn;
 	struct BlockCacheNode *bcn;
-	UQUAD sector;
-	ULONG sectors, done, todo;
-	ULONG errors = 0;
+	UQUAD cursor, first, sector;
+	UQUAD sent_first[NUM_IO_REQUESTS];
+	ULONG sent_count[NUM_IO_REQUESTS];
+	ULONG sectors, gap, max_gap, writes, req, i;
 	APTR buffer;
-	LONG res;
+	ULONG errors = 0;
+
+	max_gap = MAX_FLUSH_GAP >> bc->sector_shift;
+	cursor  = 0;
+	first   = 0;
+	sectors = 0;
+	writes  = 0;
+	req     = 0;
+	buffer  = WriteBuffer(bc, req);
+
+	for (i = 0; i < NUM_IO_REQUESTS; i++)
+		sent_count[i] = 0;
+
+	while ((brn = NextBlockRange(bc, cursor)) != NULL) {
+		cursor = brn->range.last + 1;
+
+		if (marked_only && brn->flush == FALSE)
+			continue;
+
+		/*
+		 * Pages that become clean leave the range from the front, so the page
+		 * that is being looked at always stays in the list.
+		 */
+		for (node = brn->list.mlh_Head; (succ = node->mln_Succ) != NULL; node = succ) {
+			bcn = BCNFROMNODE(node);
+
+			for (i = 0; i < bc->page_sectors; i++) {
+				if ((bcn->dirty_mask & (1UL << i)) == 0)
+					continue;
+
+				sector = (bcn->page << bc->page_shift) + i;
+
+				if (sectors > 0 && (sector != first + sectors || sectors == bc->write_buffer_size)) {
+					gap = (sector > first + sectors) ? (ULONG)MIN(sector - (first + sectors), max_gap + 1) : 0;
+
+					if (gap > 0 && gap <= max_gap && (sectors + gap) < bc->write_buffer_size &&
+						FillFlushGap(bc, first + sectors, gap, buffer + (sectors << bc->sector_shift)))
+					{
+						sectors += gap;
+					} else {
+						DeviceSendWriteBlocks(bc->dio_handle, req, first, buffer, sectors);
+						sent_first[req] = first;
+						sent_count[req] = sectors;
+						sectors = 0;
+
+						req = (req + 1) % NUM_IO_REQUESTS;
+						buffer = WriteBuffer(bc, req);
+
+						if (++writes == max_writes)
+							goto finish;
+					}
+				}
+
+				if (sectors == 0) {
+					/* The buffer is reused, so the run that was sent from it must be done. */
+					if (sent_count[req] > 0) {
+						if (!FinishDirtySectors(bc, req, sent_first[req], sent_count[req]))
+							errors++;
+						sent_count[req] = 0;
+					}
+
+					first = sector;
+				}
+
+				CopyMem(bcn->data + (i << bc->sector_shift), buffer + (sectors << bc->sector_shift), bc->sector_size);
+				sectors++;
+			}
+		}
+
+		/* The run is carried over, so it can be merged with the next range. */
+	}
+
+	if (sectors > 0) {
+		DeviceSendWriteBlocks(bc->dio_handle, req, first, buffer, sectors);
+		sent_first[req] = first;
+		sent_count[req] = sectors;
+
+		req = (req + 1) % NUM_IO_REQUESTS;
+	}
+
+finish:
+	/* The oldest run is on the request that would be used next. */
+	for (i = 0; i < NUM_IO_REQUESTS; i++) {
+		if (sent_count[req] > 0 && !FinishDirtySectors(bc, req, sent_first[req], sent_count[req]))
+			errors++;
+
+		req = (req + 1) % NUM_IO_REQUESTS;
+	}
+
+	return (errors == 0) ? TRUE : FALSE;
+}
+
+/*
+ * A partial flush picks the least recently used ranges, so that hot pages
+ * stay dirty, but still writes them in ascending order.
+ */
+BOOL FlushDirtyNodes(struct BlockCache *bc, ULONG max_dirty_nodes) {
+	struct MinNode *node;
+	struct BlockRangeNode *brn;
+	ULONG pages;
 
 	DEBUGF("FlushDirtyNodes(%#p, %u)\n", bc, max_dirty_nodes);
 
 	if (bc->write_cache_enabled == FALSE)
 		return TRUE;
 
-	if (IsMinListEmpty(&bc->dirty_list))
+	if (bc->num_dirty_nodes <= max_dirty_nodes)
 		return TRUE;
 
-	for (node = bc->dirty_list.mlh_TailPred; (pred = node->mln_Pred) != NULL; node = pred) {
+	if (max_dirty_nodes == 0)
+		return WriteBlockRanges(bc, FALSE, 0);
+
+	pages = bc->num_dirty_nodes - max_dirty_nodes;
+
+	for (node = bc->dirty_list.mlh_TailPred; node->mln_Pred != NULL; node = node->mln_Pred) {
 		brn = BRNFROMNODE(node);
 
-		sector = brn->range.first;
-		node   = brn->list.mlh_Head;
-		done   = 0;
-		todo   = brn->range.last - brn->range.first + 1;
+		brn->flush = (pages > 0) ? TRUE : FALSE;
+		if (pages > 0)
+			pages -= MIN(pages, brn->range.last - brn->range.first + 1);
+	}
 
-		do {
-			buffer  = bc->write_buffer;
-			sectors = 0;
+	return WriteBlockRanges(bc, TRUE, 0);
+}
 
-			while (sectors < bc->write_buffer_size && (succ = node->mln_Succ) != NULL) {
-				bcn = BCNFROMNODE(node);
-				CopyMem(bcn->data, buffer, bc->sector_size);
-				buffer += bc->sector_size;
-				sectors++;
-				node = succ;
-			}
+/*
+ * Writes ranges that have been dirty for at least writeback_age seconds.
+ * Only one write request is issued per call, so that this can be done in
+ * between other requests without holding them up for long.
+ */
+BOOL WriteBackDirtyNodes(struct BlockCache *bc) {
+	struct MinNode *node;
+	struct BlockRangeNode *brn;
+	ULONG now;
+	BOOL found = FALSE;
 
-			res = DeviceWriteBlocks(bc->dio_handle, sector, bc->write_buffer, sectors);
-			if (res == DIO_SUCCESS) {
-				sector += sectors;
-				done += sectors;
-			} else {
-				errors++;
-			}
+	DEBUGF("WriteBackDirtyNodes(%#p)\n", bc);
 
-			if (max_dirty_nodes && (bc->num_dirty_nodes - done) <= max_dirty_nodes)
-				break;
-		} while (res == DIO_SUCCESS && done < todo);
+	if (bc->write_cache_enabled == FALSE)
+		return TRUE;
 
-		if (done > 0) {
-			bc->cache_busy = TRUE;
+	if (IsMinListEmpty(&bc->dirty_list))
+		return TRUE;
 
-			node    = brn->list.mlh_Head;
-			sectors = 0;
+	now = GetSeconds();
 
-			while (sectors < done && (succ = node->mln_Succ) != NULL) {
-				ClearDirty(bc, BCNFROMNODE(node));
-				sectors++;
-				node = succ;
-			}
+	for (node = bc->dirty_list.mlh_TailPred; node->mln_Pred != NULL; node = node->mln_Pred) {
+		brn = BRNFROMNODE(node);
 
-			bc->cache_busy = FALSE;
+		brn->flush = ((now - brn->dirty_time) >= bc->writeback_age) ? TRUE : FALSE;
+		if (brn->flush)
+			found = TRUE;
+	}
 
-			if (max_dirty_nodes && bc->num_dirty_nodes <= max_dirty_nodes)
-				break;
-		}
+	if (found == FALSE)
+		return TRUE;
+
+	return WriteBlockRanges(bc, TRUE, 1);
+}
+
+static void ScrubCacheList(struct BlockCache *bc, struct MinList *list) {
+	struct MinNode *node, *succ;
+	struct BlockCacheNode *bcn;
+
+	for (node = list->mlh_Head; (succ = node->mln_Succ) != NULL; node = succ) {
+		bcn = BCNFROMNODE(node);
+		VerifySectors(bc, bcn, bcn->valid_mask);
+		bcn->verify_gen = bc->verify_gen;
 	}
+}
 
-	return (errors == 0) ? TRUE : FALSE;
+void ScrubCacheNodes(struct BlockCache *bc) {
+	struct MinNode *node, *succ;
+
+	DEBUGF("ScrubCacheNodes(%#p)\n", bc);
+
+	if (bc->verify_mode == DIOCV_NEVER)
+		return;
+
+	bc->cache_busy = TRUE;
+
+	ScrubCacheList(bc, &bc->probation_list);
+	ScrubCacheList(bc, &bc->protected_list);
+	ScrubCacheList(bc, &bc->pinned_list);
+	ScrubCacheList(bc, &bc->stream_list);
+
+	/* Dirty pages may hold clean sectors too */
+	for (node = bc->dirty_list.mlh_Head; (succ = node->mln_Succ) != NULL; node = succ)
+		ScrubCacheList(bc, &BRNFROMNODE(node)->list);
+
+	bc->cache_busy = FALSE;
 }
 
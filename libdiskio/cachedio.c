@@ -18,6 +18,78 @@
 
 #include "diskio_internal.h"
 
+#define READ_CHUNK_SIZE (256UL * 1024UL)
+
+/* Reads sectors that missed the cache from the device and caches them. */
+static LONG ReadUncachedBlocks(struct DiskIO *dio, UQUAD block, APTR buffer, ULONG blocks) {
+	LONG res;
+
+	/* A miss inside a single page reads in the whole page. */
+	if (LoadCacheNode(dio->block_cache, block, buffer, blocks))
+		return DIO_SUCCESS;
+
+	res = DeviceReadBlocks(dio, block, buffer, blocks);
+	if (res == DIO_SUCCESS)
+		StoreCacheNode(dio->block_cache, block, buffer, blocks, 0);
+
+	return res;
+}
+
+/* Copies dirty sectors from the cache over data that was read from the device. */
+static void PatchDirtyBlocks(struct BlockCache *bc, UQUAD block, APTR buffer, ULONG blocks) {
+	do {
+		ReadCacheNode(bc, block++, buffer, 1, RCN_DIRTY_ONLY);
+		buffer += bc->sector_size;
+	} while (--blocks);
+}
+
+/*
+ * Reads that are too big for the cache are split in chunks, so that the
+ * next chunk is read while dirty sectors are copied into the previous one.
+ */
+static LONG ReadPipelinedBlocks(struct DiskIO *dio, UQUAD block, APTR buffer, ULONG blocks) {
+	struct BlockCache *bc = dio->block_cache;
+	ULONG max_chunk = READ_CHUNK_SIZE >> dio->sector_shift;
+	ULONG req = 0, prev;
+	ULONG chunk, prev_chunk = 0;
+	UQUAD prev_block = 0;
+	APTR prev_buffer = NULL;
+	LONG res = DIO_SUCCESS, err;
+
+	while (blocks > 0 || prev_chunk > 0) {
+		chunk = MIN(blocks, max_chunk);
+		if (chunk > 0)
+			DeviceSendReadBlocks(dio, req, block, buffer, chunk);
+
+		if (prev_chunk > 0) {
+			prev = (req + NUM_IO_REQUESTS - 1) % NUM_IO_REQUESTS;
+
+			err = DeviceWaitBlocks(dio, prev);
+			if (err == DIO_SUCCESS) {
+				PatchDirtyBlocks(bc, prev_block, prev_buffer, prev_chunk);
+			} else if (res == DIO_SUCCESS) {
+				res = err;
+			}
+		}
+
+		/* After an error only the chunk that is still queued is waited for. */
+		if (res != DIO_SUCCESS)
+			blocks = chunk;
+
+		prev_block  = block;
+		prev_buffer = buffer;
+		prev_chunk  = chunk;
+
+		block  += chunk;
+		buffer += chunk << dio->sector_shift;
+		blocks -= chunk;
+
+		req = (req + 1) % NUM_IO_REQUESTS;
+	}
+
+	return res;
+}
+
 LONG CachedReadBlocks(struct DiskIO *dio, UQUAD block, APTR buffer, ULONG blocks) {
 	struct BlockCache *bc = dio->block_cache;
 	LONG res;
@@ -34,42 +106,50 @@ LONG CachedReadBlocks(struct DiskIO *dio, UQUAD block, APTR buffer, ULONG blocks
 		return DIO_SUCCESS;
 
 	if (dio->max_cached_read && blocks > dio->max_cached_read) {
-		res = DeviceReadBlocks(dio, block, buffer, blocks);
-		if (res == DIO_SUCCESS) {
-			do {
-				ReadCacheNode(bc, block++, buffer, RCN_DIRTY_ONLY);
-				buffer += dio->sector_size;
-			} while (--blocks);
-		}
+		/* Without dirty pages there is nothing to copy over the data. */
+		if (bc->num_dirty_nodes == 0)
+			return DeviceReadBlocks(dio, block, buffer, blocks);
 
-		return res;
+		return ReadPipelinedBlocks(dio, block, buffer, blocks);
 	} else {
 		ULONG uncached = 0;
+		ULONG cached;
 
+		/* Cached sectors are copied a page at a time. */
 		do {
-			if (blocks > 0 && ReadCacheNode(bc, block, buffer, 0) == FALSE)
+			cached = ReadCacheNode(bc, block, buffer, blocks, 0);
+			if (cached == 0) {
 				uncached++;
-			else if (uncached) {
-				UQUAD blk = block - uncached;
-				APTR buf = buffer - (uncached << dio->sector_shift);
-
-				res = DeviceReadBlocks(dio, blk, buf, uncached);
-				if (res == DIO_SUCCESS) {
-					do {
-						StoreCacheNode(bc, blk++, buf, 0);
-						buf += dio->sector_size;
-					} while (--uncached);
-				} else
+				cached = 1;
+			} else if (uncached) {
+				res = ReadUncachedBlocks(dio, block - uncached, buffer - (uncached << dio->sector_shift), uncached);
+				if (res != DIO_SUCCESS)
 					return res;
+				uncached = 0;
 			}
-			block++;
-			buffer += dio->sector_size;
-		} while (blocks--);
+			block  += cached;
+			buffer += cached << dio->sector_shift;
+			blocks -= cached;
+		} while (blocks);
+
+		if (uncached)
+			return ReadUncachedBlocks(dio, block - uncached, buffer - (uncached << dio->sector_shift), uncached);
 
 		return DIO_SUCCESS;
 	}
 }
 
+/* Writes sectors that didn't fit in the cache straight to the device. */
+static LONG WriteUncachedBlocks(struct DiskIO *dio, UQUAD block, CONST_APTR buffer, ULONG blocks) {
+	LONG res;
+
+	res = DeviceWriteBlocks(dio, block, buffer, blocks);
+	if (res == DIO_SUCCESS)
+		StoreCacheNode(dio->block_cache, block, buffer, blocks, SCN_CLEAR_DIRTY);
+
+	return res;
+}
+
 LONG CachedWriteBlocks(struct DiskIO *dio, UQUAD block, CONST_APTR buffer, ULONG blocks) {
 	struct BlockCache *bc = dio->block_cache;
 	BOOL bigwrite = FALSE;
@@ -96,39 +176,36 @@ LONG CachedWriteBlocks(struct DiskIO *dio, UQUAD block, CONST_APTR buffer, ULONG
 			scn_flags |= SCN_UPDATE_ONLY;
 
 		res = DeviceWriteBlocks(dio, block, buffer, blocks);
-		if (res == DIO_SUCCESS) {
-			do {
-				StoreCacheNode(bc, block++, buffer, scn_flags);
-				buffer += dio->sector_size;
-			} while (--blocks);
-		}
+		if (res == DIO_SUCCESS)
+			StoreCacheNode(bc, block, buffer, blocks, scn_flags);
 
 		return res;
 	} else {
 		ULONG uncached = 0;
+		ULONG cached;
 
-		if ((bc->num_dirty_nodes + blocks) >= bc->max_dirty_nodes)
+		/* Dirty nodes are counted in pages */
+		if ((bc->num_dirty_nodes + (blocks >> bc->page_shift) + 1) >= bc->max_dirty_nodes)
 			FlushDirtyNodes(bc, bc->low_threshold);
 
 		do {
-			if (blocks > 0 && WriteCacheNode(bc, block, buffer, 0) == FALSE)
+			cached = WriteCacheNode(bc, block, buffer, blocks, 0);
+			if (cached == 0) {
 				uncached++;
-			else if (uncached) {
-				UQUAD blk = block - uncached;
-				CONST_APTR buf = buffer - (uncached << dio->sector_shift);
-
-				res = DeviceWriteBlocks(dio, blk, buf, uncached);
-				if (res == DIO_SUCCESS) {
-					do {
-						StoreCacheNode(bc, blk++, buf, SCN_CLEAR_DIRTY);
-						buf += dio->sector_size;
-					} while (--uncached);
-				} else
+				cached = 1;
+			} else if (uncached) {
+				res = WriteUncachedBlocks(dio, block - uncached, buffer - (uncached << dio->sector_shift), uncached);
+				if (res != DIO_SUCCESS)
 					return res;
+				uncached = 0;
 			}
-			block++;
-			buffer += dio->sector_size;
-		} while (blocks--);
+			block  += cached;
+			buffer += cached << dio->sector_shift;
+			blocks -= cached;
+		} while (blocks);
+
+		if (uncached)
+			return WriteUncachedBlocks(dio, block - uncached, buffer - (uncached << dio->sector_shift), uncached);
 
 		return DIO_SUCCESS;
 	}
@@ -19,6 +19,8 @@
 #include "diskio_internal.h"
 
 void DIO_Cleanup(struct DiskIO *dio) {
+	ULONG i;
+
 	DEBUGF("DIO_Cleanup(%#p)\n", dio);
 
 	if (dio != NULL) {
@@ -28,6 +30,11 @@ void DIO_Cleanup(struct DiskIO *dio) {
 
 		if (dio->mempool != NULL) DeletePool(dio->mempool);
 
+		for (i = 0; i < NUM_IO_REQUESTS; i++) {
+			if (dio->io_ring[i].iotd != NULL)
+				DeleteIORequest((struct IORequest *)dio->io_ring[i].iotd);
+		}
+
 		if (dio->diskiotd != NULL) {
 			if (dio->diskiotd->iotd_Req.io_Device != NULL)
 				CloseDevice((struct IORequest *)dio->diskiotd);
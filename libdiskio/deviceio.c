@@ -18,9 +18,18 @@
 
 #include "diskio_internal.h"
 
+static void SetupTransfer(struct DiskIO *dio, struct IOExtTD *iotd, UWORD cmd, UQUAD block, APTR buffer, ULONG blocks) {
+	UQUAD offset = dio->partition_start + (block << dio->sector_shift);
+
+	iotd->iotd_Req.io_Command = cmd;
+	iotd->iotd_Req.io_Data = buffer;
+	iotd->iotd_Req.io_Actual = offset >> 32;
+	iotd->iotd_Req.io_Offset = offset;
+	iotd->iotd_Req.io_Length = blocks << dio->sector_shift;
+	iotd->iotd_Count = dio->disk_id;
+}
+
 LONG DeviceReadBlocks(struct DiskIO *dio, UQUAD block, APTR buffer, ULONG blocks) {
-	UQUAD offset;
-	ULONG bytes;
 	struct IOExtTD *iotd;
 	int error;
 	LONG res = DIO_SUCCESS;
@@ -34,15 +43,7 @@ LONG DeviceReadBlocks(struct DiskIO *dio, UQUAD block, APTR buffer, ULONG blocks
 		return DIO_SUCCESS;
 
 	iotd = dio->diskiotd;
-	offset = dio->partition_start + (block << dio->sector_shift);
-	bytes = blocks << dio->sector_shift;
-
-	iotd->iotd_Req.io_Command = dio->read_cmd;
-	iotd->iotd_Req.io_Data = (APTR)buffer;
-	iotd->iotd_Req.io_Actual = offset >> 32;
-	iotd->iotd_Req.io_Offset = offset;
-	iotd->iotd_Req.io_Length = bytes;
-	iotd->iotd_Count = dio->disk_id;
+	SetupTransfer(dio, iotd, dio->read_cmd, block, buffer, blocks);
 
 	error = DoIO((struct IORequest *)iotd);
 	if (error != 0) {
@@ -54,8 +55,6 @@ LONG DeviceReadBlocks(struct DiskIO *dio, UQUAD block, APTR buffer, ULONG blocks
 }
 
 LONG DeviceWriteBlocks(struct DiskIO *dio, UQUAD block, CONST_APTR buffer, ULONG blocks) {
-	UQUAD offset;
-	ULONG bytes;
 	struct IOExtTD *iotd;
 	int error;
 	LONG res = DIO_SUCCESS;
@@ -69,15 +68,7 @@ LONG DeviceWriteBlocks(struct DiskIO *dio, UQUAD block, CONST_APTR buffer, ULONG
 		return DIO_SUCCESS;
 
 	iotd = dio->diskiotd;
-	offset = dio->partition_start + (block << dio->sector_shift);
-	bytes = blocks << dio->sector_shift;
-
-	iotd->iotd_Req.io_Command = dio->write_cmd;
-	iotd->iotd_Req.io_Data = (APTR)buffer;
-	iotd->iotd_Req.io_Actual = offset >> 32;
-	iotd->iotd_Req.io_Offset = offset;
-	iotd->iotd_Req.io_Length = bytes;
-	iotd->iotd_Count = dio->disk_id;
+	SetupTransfer(dio, iotd, dio->write_cmd, block, (APTR)buffer, blocks);
 
 	error = DoIO((struct IORequest *)iotd);
 	if (error != 0) {
@@ -86,10 +77,75 @@ LONG DeviceWriteBlocks(struct DiskIO *dio, UQUAD block, CONST_APTR buffer, ULONG
 	}
 
 	dio->doupdate = TRUE;
+	dio->sectors_written += blocks;
 
 	return res;
 }
 
+/*
+ * Queues a transfer on request req of the ring. The buffer must be left
+ * alone until DeviceWaitBlocks() has been called for the same request,
+ * which also returns any error. If the ring could not be allocated the
+ * transfer is done right away.
+ */
+static void SendBlocks(struct DiskIO *dio, ULONG req, BOOL write, UQUAD block, APTR buffer, ULONG blocks) {
+	struct DeviceRequest *dr = &dio->io_ring[req];
+
+	if (block >= dio->total_sectors || (block + (UQUAD)blocks) > dio->total_sectors) {
+		dr->result = DIO_ERROR_OUTOFBOUNDS;
+		return;
+	}
+
+	if (dr->iotd == NULL || blocks == 0) {
+		if (write)
+			dr->result = DeviceWriteBlocks(dio, block, buffer, blocks);
+		else
+			dr->result = DeviceReadBlocks(dio, block, buffer, blocks);
+		return;
+	}
+
+	SetupTransfer(dio, dr->iotd, write ? dio->write_cmd : dio->read_cmd, block, buffer, blocks);
+
+	SendIO((struct IORequest *)dr->iotd);
+	dr->pending = TRUE;
+
+	if (write)
+		dio->sectors_written += blocks;
+}
+
+void DeviceSendReadBlocks(struct DiskIO *dio, ULONG req, UQUAD block, APTR buffer, ULONG blocks) {
+	DEBUGF("DeviceSendReadBlocks(%#p, %u, %llu, %#p, %u)\n", dio, req, block, buffer, blocks);
+
+	SendBlocks(dio, req, FALSE, block, buffer, blocks);
+}
+
+void DeviceSendWriteBlocks(struct DiskIO *dio, ULONG req, UQUAD block, CONST_APTR buffer, ULONG blocks) {
+	DEBUGF("DeviceSendWriteBlocks(%#p, %u, %llu, %#p, %u)\n", dio, req, block, buffer, blocks);
+
+	SendBlocks(dio, req, TRUE, block, (APTR)buffer, blocks);
+
+	dio->doupdate = TRUE;
+}
+
+LONG DeviceWaitBlocks(struct DiskIO *dio, ULONG req) {
+	struct DeviceRequest *dr = &dio->io_ring[req];
+	int error;
+
+	if (dr->pending) {
+		dr->pending = FALSE;
+
+		error = WaitIO((struct IORequest *)dr->iotd);
+		if (error != 0) {
+			DEBUGF("DeviceWaitBlocks failed - io error %d\n", error);
+			dr->result = DIO_ERROR_UNSPECIFIED;
+		} else {
+			dr->result = DIO_SUCCESS;
+		}
+	}
+
+	return dr->result;
+}
+
 LONG DeviceUpdate(struct DiskIO *dio) {
 	if (dio->doupdate) {
 		dio->doupdate = FALSE;
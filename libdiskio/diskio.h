@@ -50,6 +50,32 @@ struct DiskIO; /* This is a library private structure, do not touch! */
 #define DIOS_DOSTypeMask    (DIOS_Dummy + 5) /* (uint32) Which bits of dostype to check and which to ignore */
 #define DIOS_Error          (DIOS_Dummy + 6) /* (int32 *) Error code if Setup() failed */
 #define DIOS_ReadOnly       (DIOS_Dummy + 7) /* (BOOL) Enable/disable read-only mode */
+#define DIOS_CachePageSize  (DIOS_Dummy + 8) /* (uint32) Size of cache pages in bytes (default: 4096) */
+#define DIOS_CacheVerify    (DIOS_Dummy + 9) /* (uint32) When cached data is checked for corruption (default: DIOCV_ALWAYS) */
+#define DIOS_VerifyPeriod   (DIOS_Dummy + 10) /* (uint32) Check every Nth read hit with DIOCV_SAMPLED (default: 16) */
+#define DIOS_CachePolicy    (DIOS_Dummy + 11) /* (uint32) Replacement policy of the read cache (default: DIOCP_SLRU) */
+#define DIOS_WriteBackAge   (DIOS_Dummy + 12) /* (uint32) Seconds before DIO_WriteBackIOCache() writes dirty data (default: 5) */
+
+/* Values for DIOS_CachePolicy */
+enum {
+	DIOCP_SLRU = 0, /* Segmented LRU with a fixed size protected segment */
+	DIOCP_ARC       /* Adaptive replacement cache */
+};
+
+/* Values for DIOS_CacheVerify */
+enum {
+	DIOCV_NEVER = 0, /* Never check cached data */
+	DIOCV_ALWAYS,    /* Check on every read hit */
+	DIOCV_SAMPLED,   /* Check on every Nth read hit */
+	DIOCV_SCRUB      /* Check only after the memory handler or DIO_ScrubIOCache() has run */
+};
+
+/* Hints for DIO_ReadBytesHint() and DIO_WriteBytesHint() */
+enum {
+	DIOCH_DEFAULT = 0, /* Left to the replacement policy */
+	DIOCH_METADATA,    /* Filesystem metadata, cached in the protected segment straight away */
+	DIOCH_DATA         /* File data, cached in a smaller share of its own that is never protected */
+};
 
 /* Tags for DIO_Query() */
 #define DIOQ_Dummy          (TAG_USER)
@@ -62,6 +88,9 @@ struct DiskIO; /* This is a library private structure, do not touch! */
 #define DIOQ_SectorMask     (DIOQ_Dummy + 7) /* (uint32) */
 #define DIOQ_TotalBytes     (DIOQ_Dummy + 8) /* (uint64) Total size of disk/partition */
 #define DIOQ_DOSDevName     (DIOQ_Dummy + 9) /* (CONST_STRPTR) Name of DOS device ("USB0:", "DH1:") */
+#define DIOQ_PartialWrites  (DIOQ_Dummy + 10) /* (uint64) Writes by DIO_WriteBytes() to part of a sector */
+#define DIOQ_PatchedWrites  (DIOQ_Dummy + 11) /* (uint64) Partial writes that were copied straight into the cache */
+#define DIOQ_SectorsWritten (DIOQ_Dummy + 12) /* (uint64) Sectors written to the device */
 
 enum {
 	DIO_SUCCESS = 0,       /* Success */
@@ -84,7 +113,13 @@ void DIO_Update(struct DiskIO *dio);
 void DIO_Query(struct DiskIO *dio, const struct TagItem *tags);
 int DIO_ReadBytes(struct DiskIO *dio, UQUAD offset, APTR buffer, ULONG bytes);
 int DIO_WriteBytes(struct DiskIO *dio, UQUAD offset, CONST_APTR buffer, ULONG bytes);
+int DIO_ReadBytesHint(struct DiskIO *dio, UQUAD offset, APTR buffer, ULONG bytes, ULONG hint);
+int DIO_WriteBytesHint(struct DiskIO *dio, UQUAD offset, CONST_APTR buffer, ULONG bytes, ULONG hint);
 int DIO_FlushIOCache(struct DiskIO *dio);
+int DIO_ScrubIOCache(struct DiskIO *dio);
+int DIO_WriteBackIOCache(struct DiskIO *dio);
+CONST_APTR DIO_GetBlocks(struct DiskIO *dio, UQUAD block, ULONG blocks);
+void DIO_ReleaseBlocks(struct DiskIO *dio, CONST_APTR data);
 
 #ifdef __AROS__
 #define DIO_SetupTags(dio, ...) \
@@ -31,7 +31,6 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stddef.h>
-#include "splay.h"
 
 #ifndef __AROS__
 #include <SDI/SDI_compiler.h>
@@ -87,27 +86,55 @@ typedef struct { } LABEL;
 typedef char LABEL;
 #endif
 
+/* Number of pages that can be pinned by DIO_GetBlocks() at the same time. */
+#define MAX_PINNED_PAGES 16
+
 struct BlockCache {
 	struct MinNode         node;
 	struct DiskIO         *dio_handle;
 	APTR                   mempool;
 	ULONG                  sector_size;
 	ULONG                  sector_shift;
+	ULONG                  page_size;
+	ULONG                  page_sectors;
+	ULONG                  page_shift;
 	APTR                   write_buffer;
 	ULONG                  write_buffer_size;
 	struct MinList         probation_list;
 	struct MinList         protected_list;
 	struct MinList         dirty_list;
-	struct Splay          *cache_tree;
-	struct Splay          *range_tree;
+	struct MinList         pinned_list;
+	struct MinList         stream_list;
+	struct BlockCacheNode **hash_table;
+	ULONG                  hash_mask;
+	struct BlockRangeNode **range_index;
+	ULONG                  num_ranges;
+	ULONG                  max_ranges;
 	ULONG                  num_protected_nodes;
 	ULONG                  num_dirty_nodes;
 	ULONG                  num_cache_nodes;
+	ULONG                  num_pinned_nodes;
+	ULONG                  num_stream_nodes;
 	ULONG                  max_protected_nodes;
+	ULONG                  max_stream_nodes;
 	ULONG                  max_dirty_nodes;
 	ULONG                  max_cache_nodes;
 	ULONG                  high_threshold;
 	ULONG                  low_threshold;
+	ULONG                  writeback_age;
+	ULONG                  cache_policy;
+	ULONG                  cache_hint;
+	ULONG                  arc_target;
+	struct MinList         recent_ghost_list;
+	struct MinList         frequent_ghost_list;
+	struct GhostNode     **ghost_table;
+	ULONG                  num_recent_ghosts;
+	ULONG                  num_frequent_ghosts;
+	ULONG                  verify_mode;
+	ULONG                  verify_period;
+	ULONG                  verify_count;
+	ULONG                  verify_gen;
+	struct BlockCacheNode *pinned_pages[MAX_PINNED_PAGES];
 	struct Interrupt       mem_handler;
 	BOOL                   cache_busy;
 	BOOL                   write_cache_enabled;
@@ -118,34 +145,68 @@ struct BlockRange {
 	UQUAD last;
 };
 
+/* Dirty ranges are kept in range_index sorted by their first page. */
 struct BlockRangeNode {
-	struct Splay      splay;
 	struct MinNode    node;
 	struct BlockRange range;
 	struct MinList    list;
+	ULONG             dirty_time;
+	BOOL              flush;
 };
 
-#define BRNFROMSPLAY(s) container_of(s, struct BlockRangeNode, splay)
 #define BRNFROMNODE(n)  container_of(n, struct BlockRangeNode, node)
 
+/*
+ * A cache page holds page_sectors sectors, each with a valid and dirty bit and a checksum.
+ * Clean pages that are pinned are kept on pinned_list, where they can't be evicted.
+ * Clean pages that were cached with DIOCH_DATA are kept on stream_list instead.
+ */
 struct BlockCacheNode {
-	struct Splay           splay;
+	struct BlockCacheNode  *hash_next;
+	struct BlockCacheNode **hash_pprev;
 	struct MinNode         node;
-	UQUAD                  sector;
+	UQUAD                  page;
 	APTR                   data;
 	struct BlockRangeNode *range_node;
+	ULONG                  valid_mask;
+	ULONG                  dirty_mask;
+	ULONG                 *checksums;
+	ULONG                  verify_gen;
 	UBYTE                  type;
-	UBYTE                  pad[3];
-	ULONG                  checksum;
+	UBYTE                  hint;
+	UWORD                  pin_count;
 };
 
-#define BCNFROMSPLAY(s) container_of(s, struct BlockCacheNode, splay)
 #define BCNFROMNODE(n)  container_of(n, struct BlockCacheNode, node)
 
+/* Remembers a page that ARC evicted, type is the list it was evicted from. */
+struct GhostNode {
+	struct GhostNode  *hash_next;
+	struct GhostNode **hash_pprev;
+	struct MinNode     node;
+	UQUAD              page;
+	UBYTE              type;
+	UBYTE              pad[3];
+};
+
+#define GNFROMNODE(n)   container_of(n, struct GhostNode, node)
+
 enum {
 	BCN_PROBATION = 1,
 	BCN_PROTECTED,
-	BCN_DIRTY
+	BCN_DIRTY,
+	BCN_PINNED,
+	BCN_STREAM
+};
+
+/* Number of requests that can be queued with DeviceSend*Blocks(). */
+#define NUM_IO_REQUESTS 2
+
+/* A request of the ring, iotd is NULL if it could not be allocated. */
+struct DeviceRequest {
+	struct IOExtTD *iotd;
+	LONG            result;
+	BOOL            pending;
 };
 
 struct DiskIO {
@@ -153,8 +214,14 @@ struct DiskIO {
 	APTR               mempool;
 	struct MsgPort    *diskmp;
 	struct IOExtTD    *diskiotd;
+	struct DeviceRequest io_ring[NUM_IO_REQUESTS];
 	UWORD              cmd_support;
 	UWORD              update_cmd;
+	ULONG              cache_page_size;
+	ULONG              cache_policy;
+	ULONG              cache_verify;
+	ULONG              verify_period;
+	ULONG              writeback_age;
 	BOOL               cache_enabled;
 	BOOL               write_cache_enabled;
 	BOOL               inhibit;
@@ -188,6 +255,9 @@ struct DiskIO {
 	BOOL               disk_present;
 	BOOL               disk_ok;
 	BOOL               write_protected;
+	UQUAD              partial_writes;
+	UQUAD              patched_writes;
+	UQUAD              sectors_written;
 	LABEL              UPDATE_DATA_END;
 
 	/* Buffer used to store the DOS device name */
@@ -226,6 +296,9 @@ BOOL Internal_Update(struct DiskIO *dio, BOOL setup);
 /* deviceio.c */
 LONG DeviceReadBlocks(struct DiskIO *dio, UQUAD block, APTR buffer, ULONG blocks);
 LONG DeviceWriteBlocks(struct DiskIO *dio, UQUAD block, CONST_APTR buffer, ULONG blocks);
+void DeviceSendReadBlocks(struct DiskIO *dio, ULONG req, UQUAD block, APTR buffer, ULONG blocks);
+void DeviceSendWriteBlocks(struct DiskIO *dio, ULONG req, UQUAD block, CONST_APTR buffer, ULONG blocks);
+LONG DeviceWaitBlocks(struct DiskIO *dio, ULONG req);
 LONG DeviceUpdate(struct DiskIO *dio);
 
 /* cachedio.c */
@@ -236,10 +309,17 @@ LONG CachedWriteBlocks(struct DiskIO *dio, UQUAD block, CONST_APTR buffer, ULONG
 struct BlockCache *InitBlockCache(struct DiskIO *dio);
 void CleanupBlockCache(struct BlockCache *bc);
 void ExpungeCacheNode(struct BlockCache *bc, struct BlockCacheNode *bcn);
-BOOL ReadCacheNode(struct BlockCache *bc, UQUAD sector, APTR buffer, ULONG flags);
-BOOL StoreCacheNode(struct BlockCache *bc, UQUAD sector, CONST_APTR buffer, ULONG flags);
-BOOL WriteCacheNode(struct BlockCache *bc, UQUAD sector, CONST_APTR buffer, ULONG flags);
+void ScrubCacheNodes(struct BlockCache *bc);
+BOOL ProbeCacheNode(struct BlockCache *bc, UQUAD sector);
+ULONG ReadCacheNode(struct BlockCache *bc, UQUAD sector, APTR buffer, ULONG count, ULONG flags);
+BOOL LoadCacheNode(struct BlockCache *bc, UQUAD sector, APTR buffer, ULONG count);
+void StoreCacheNode(struct BlockCache *bc, UQUAD sector, CONST_APTR buffer, ULONG count, ULONG flags);
+ULONG WriteCacheNode(struct BlockCache *bc, UQUAD sector, CONST_APTR buffer, ULONG count, ULONG flags);
+BOOL PatchCacheNode(struct BlockCache *bc, UQUAD sector, ULONG offset, CONST_APTR buffer, ULONG bytes);
+APTR PinCacheNode(struct BlockCache *bc, UQUAD sector, ULONG count);
+void UnpinCacheNode(struct BlockCache *bc, CONST_APTR data);
 BOOL FlushDirtyNodes(struct BlockCache *bc, ULONG max_dirty_nodes);
+BOOL WriteBackDirtyNodes(struct BlockCache *bc);
 
 /* memhandler.c */
 #ifdef __AROS__
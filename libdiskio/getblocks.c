@@ -0,0 +1,49 @@
+/**
+ * Copyright (c) 2015-2026 Fredrik Wikstrom <fredrik@a500.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "diskio_internal.h"
+
+/*
+ * Returns a pointer to the cached data of the given sectors, which must all
+ * be in the same cache page, or NULL if that is not possible. The data may
+ * only be read and must be released with DIO_ReleaseBlocks() before the
+ * next DIO_Update().
+ */
+CONST_APTR DIO_GetBlocks(struct DiskIO *dio, UQUAD block, ULONG blocks) {
+	struct BlockCache *bc;
+	APTR data;
+
+	DEBUGF("DIO_GetBlocks(%#p, %llu, %u)\n", dio, block, blocks);
+
+	if (dio == NULL || dio->disk_ok == FALSE || dio->block_cache == NULL)
+		return NULL;
+
+	if (block >= dio->total_sectors || (block + (UQUAD)blocks) > dio->total_sectors)
+		return NULL;
+
+	if (blocks == 0 || blocks > dio->read_buffer_size)
+		return NULL;
+
+	bc = dio->block_cache;
+
+	data = PinCacheNode(bc, block, blocks);
+	if (data == NULL && LoadCacheNode(bc, block, dio->read_buffer, blocks))
+		data = PinCacheNode(bc, block, blocks);
+
+	return data;
+}
+
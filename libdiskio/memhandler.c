@@ -43,6 +43,9 @@ AROS_UFH5(int, DiskIOMemHandler,
 
 	DEBUGF("DiskIOMemHandler(%#p, %#p, %#p)\n", SysBase, memh, bc);
 
+	/* With DIOCV_SCRUB pages are checked again on their next read hit. */
+	bc->verify_gen++;
+
 	if (bc->cache_busy)
 		return MEM_DID_NOTHING;
 
@@ -50,9 +53,12 @@ AROS_UFH5(int, DiskIOMemHandler,
 
 	freed = 0;
 	goal = memh->memh_RequestSize;
-	for (i = 0; i < 2; i++) {
+	for (i = 0; i < 3; i++) {
 		switch (i) {
 			case 0:
+				list = &bc->stream_list;
+				break;
+			case 1:
 				list = &bc->probation_list;
 				break;
 			default:
@@ -62,7 +68,7 @@ AROS_UFH5(int, DiskIOMemHandler,
 
 		for (node = list->mlh_TailPred; (pred = node->mln_Pred) != NULL; node = pred) {
 			ExpungeCacheNode(bc, BCNFROMNODE(node));
-			freed += bc->sector_size;
+			freed += bc->page_size;
 		}
 
 		if (freed >= goal)
@@ -73,7 +79,7 @@ AROS_UFH5(int, DiskIOMemHandler,
 
 	if (freed == 0)
 		return MEM_DID_NOTHING;
-	else if (i < 2)
+	else if (i < 3)
 		return MEM_TRY_AGAIN;
 	else
 		return MEM_ALL_DONE;
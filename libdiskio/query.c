@@ -65,6 +65,18 @@ void DIO_Query(struct DiskIO *dio, const struct TagItem *tags) {
 				*(CONST_STRPTR *)data = dio->devname;
 				break;
 
+			case DIOQ_PartialWrites:
+				*(UQUAD *)data = dio->partial_writes;
+				break;
+
+			case DIOQ_PatchedWrites:
+				*(UQUAD *)data = dio->patched_writes;
+				break;
+
+			case DIOQ_SectorsWritten:
+				*(UQUAD *)data = dio->sectors_written;
+				break;
+
 		}
 	}
 }
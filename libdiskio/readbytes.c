@@ -34,7 +34,7 @@ int DIO_ReadBytes(struct DiskIO *dio, UQUAD offset, APTR buffer, ULONG bytes)
 		if (dio->cache_enabled && dio->read_buffer_size > 1) {
 			blocks = (boffs + bytes + dio->sector_mask) >> dio->sector_shift;
 			while (blocks < dio->read_buffer_size && (block + blocks) < dio->total_sectors &&
-				ReadCacheNode(dio->block_cache, block + blocks, NULL, 0) == FALSE)
+				ProbeCacheNode(dio->block_cache, block + blocks) == FALSE)
 			{
 				blocks++;
 			}
@@ -79,3 +79,17 @@ int DIO_ReadBytes(struct DiskIO *dio, UQUAD offset, APTR buffer, ULONG bytes)
 	return res;
 }
 
+/* Like DIO_ReadBytes(), hint tells the cache what kind of data is read. */
+int DIO_ReadBytesHint(struct DiskIO *dio, UQUAD offset, APTR buffer, ULONG bytes, ULONG hint)
+{
+	int res;
+
+	if (dio == NULL || dio->block_cache == NULL)
+		return DIO_ReadBytes(dio, offset, buffer, bytes);
+
+	dio->block_cache->cache_hint = hint;
+	res = DIO_ReadBytes(dio, offset, buffer, bytes);
+	dio->block_cache->cache_hint = DIOCH_DEFAULT;
+
+	return res;
+}
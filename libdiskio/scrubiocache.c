@@ -16,29 +16,17 @@
  * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-#ifndef SPLAY_H
-#define SPLAY_H
+#include "diskio_internal.h"
 
-#ifndef EXEC_TYPES_H
-#include <exec/types.h>
-#endif
+int DIO_ScrubIOCache(struct DiskIO *dio) {
+	DEBUGF("DIO_ScrubIOCache(%#p)\n", dio);
 
-struct Splay {
-	struct Splay *parent;
-	struct Splay *left;
-	struct Splay *right;
-	CONST_APTR    key;
-};
+	if (dio == NULL || dio->disk_ok == FALSE)
+		return DIO_ERROR_UNSPECIFIED;
 
-typedef int (*SplayCmpFunc)(CONST_APTR key1, CONST_APTR key2);
+	if (dio->block_cache != NULL)
+		ScrubCacheNodes(dio->block_cache);
 
-void InsertSplay(struct Splay **root, SplayCmpFunc cmpfunc, struct Splay *sn, CONST_APTR key);
-struct Splay *FindSplay(struct Splay **root, SplayCmpFunc cmpfunc, CONST_APTR key);
-struct Splay *FirstSplay(struct Splay **root);
-struct Splay *LastSplay(struct Splay **root);
-struct Splay *PrevSplay(struct Splay *sn);
-struct Splay *NextSplay(struct Splay *sn);
-void RemoveSplay(struct Splay **root, struct Splay *sn);
-
-#endif
+	return DIO_SUCCESS;
+}
 
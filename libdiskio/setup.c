@@ -37,6 +37,7 @@ struct DiskIO *DIO_Setup(CONST_STRPTR name, const struct TagItem *tags) {
 	struct NSDeviceQueryResult nsdqr;
 	int error = DIO_ERROR_UNSPECIFIED;
 	int *error_storage;
+	ULONG i;
 
 	DEBUGF("DIO_Setup('%s', %#p)\n", name, tags);
 
@@ -52,6 +53,11 @@ struct DiskIO *DIO_Setup(CONST_STRPTR name, const struct TagItem *tags) {
 	/* Enable caches by default */
 	dio->cache_enabled       = TRUE;
 	dio->write_cache_enabled = TRUE;
+	dio->cache_page_size     = 4096;
+	dio->cache_policy        = DIOCP_SLRU;
+	dio->cache_verify        = DIOCV_ALWAYS;
+	dio->verify_period       = 16;
+	dio->writeback_age       = 5;
 
 	tstate = (struct TagItem *)tags;
 	while ((tag = NextTagItem(&tstate)) != NULL) {
@@ -76,6 +82,21 @@ struct DiskIO *DIO_Setup(CONST_STRPTR name, const struct TagItem *tags) {
 			case DIOS_ReadOnly:
 				dio->read_only = !!tag->ti_Data;
 				break;
+			case DIOS_CachePageSize:
+				dio->cache_page_size = tag->ti_Data;
+				break;
+			case DIOS_CacheVerify:
+				dio->cache_verify = tag->ti_Data;
+				break;
+			case DIOS_VerifyPeriod:
+				dio->verify_period = tag->ti_Data;
+				break;
+			case DIOS_CachePolicy:
+				dio->cache_policy = tag->ti_Data;
+				break;
+			case DIOS_WriteBackAge:
+				dio->writeback_age = tag->ti_Data;
+				break;
 		}
 	}
 
@@ -136,6 +157,13 @@ struct DiskIO *DIO_Setup(CONST_STRPTR name, const struct TagItem *tags) {
 		goto cleanup;
 	}
 
+	/* Copies of the opened request for queued transfers, these are optional. */
+	for (i = 0; i < NUM_IO_REQUESTS; i++) {
+		dio->io_ring[i].iotd = CreateIORequest(dio->diskmp, sizeof(*iotd));
+		if (dio->io_ring[i].iotd != NULL)
+			CopyMem(iotd, dio->io_ring[i].iotd, sizeof(*iotd));
+	}
+
 	if (de->de_LowCyl == 0) {
 		dio->use_full_disk = TRUE;
 	} else {
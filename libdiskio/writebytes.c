@@ -18,6 +18,37 @@
 
 #include "diskio_internal.h"
 
+/*
+ * Writes to part of a sector. If the write cache allows it, the sector is
+ * brought into the cache and patched there, otherwise it is read into the
+ * read buffer and written back as a whole.
+ */
+static int WritePartialBlock(struct DiskIO *dio, UQUAD block, ULONG boffs, CONST_APTR buffer, ULONG bytes) {
+	struct BlockCache *bc = dio->block_cache;
+	APTR sector_buffer = dio->read_buffer;
+	int res;
+
+	if (block >= dio->total_sectors)
+		return DIO_ERROR_OUTOFBOUNDS;
+
+	dio->partial_writes++;
+
+	if (bc != NULL && bc->write_cache_enabled) {
+		if (PatchCacheNode(bc, block, boffs, buffer, bytes) ||
+			(ProbeCacheNode(bc, block) == FALSE && LoadCacheNode(bc, block, sector_buffer, 1) &&
+			PatchCacheNode(bc, block, boffs, buffer, bytes)))
+		{
+			dio->patched_writes++;
+			return DIO_SUCCESS;
+		}
+	}
+
+	res = CachedReadBlocks(dio, block, sector_buffer, 1);
+	if (res) return res;
+	CopyMem((APTR)buffer, sector_buffer + boffs, bytes);
+	return CachedWriteBlocks(dio, block, sector_buffer, 1);
+}
+
 int DIO_WriteBytes(struct DiskIO *dio, UQUAD offset, CONST_APTR buffer, ULONG bytes) {
 	DEBUGF("DIO_WriteBytes(%#p, %llu, %#p, %lu)\n", dio, offset, buffer, bytes);
 
@@ -25,7 +56,6 @@ int DIO_WriteBytes(struct DiskIO *dio, UQUAD offset, CONST_APTR buffer, ULONG by
 
 	if (dio->read_only) return DIO_ERROR_READONLY;
 
-	APTR sector_buffer = dio->read_buffer;
 	UQUAD block = offset >> dio->sector_shift;
 	ULONG boffs = offset & dio->sector_mask;
 	int res = DIO_SUCCESS;
@@ -33,10 +63,7 @@ int DIO_WriteBytes(struct DiskIO *dio, UQUAD offset, CONST_APTR buffer, ULONG by
 	do {
 		if (boffs) {
 			ULONG blen = MIN(dio->sector_size - boffs, bytes);
-			res = CachedReadBlocks(dio, block, sector_buffer, 1);
-			if (res) break;
-			CopyMem((APTR)buffer, sector_buffer + boffs, blen);
-			res = CachedWriteBlocks(dio, block, sector_buffer, 1);
+			res = WritePartialBlock(dio, block, boffs, buffer, blen);
 			if (res) break;
 			buffer += blen;
 			bytes -= blen;
@@ -54,10 +81,7 @@ int DIO_WriteBytes(struct DiskIO *dio, UQUAD offset, CONST_APTR buffer, ULONG by
 		}
 
 		if (bytes) {
-			res = CachedReadBlocks(dio, block, sector_buffer, 1);
-			if (res) break;
-			CopyMem((APTR)buffer, sector_buffer, bytes);
-			res = CachedWriteBlocks(dio, block, sector_buffer, 1);
+			res = WritePartialBlock(dio, block, 0, buffer, bytes);
 			if (res) break;
 		}
 	} while (0);
@@ -67,3 +91,16 @@ int DIO_WriteBytes(struct DiskIO *dio, UQUAD offset, CONST_APTR buffer, ULONG by
 	return res;
 }
 
+/* Like DIO_WriteBytes(), hint tells the cache what kind of data is written. */
+int DIO_WriteBytesHint(struct DiskIO *dio, UQUAD offset, CONST_APTR buffer, ULONG bytes, ULONG hint) {
+	int res;
+
+	if (dio == NULL || dio->block_cache == NULL)
+		return DIO_WriteBytes(dio, offset, buffer, bytes);
+
+	dio->block_cache->cache_hint = hint;
+	res = DIO_WriteBytes(dio, offset, buffer, bytes);
+	dio->block_cache->cache_hint = DIOCH_DEFAULT;
+
+	return res;
+}
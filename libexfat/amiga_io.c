@@ -15,13 +15,72 @@ struct exfat_dev
 	UQUAD total_size;
 	BOOL read_only;
 	BOOL dirty;
+	BOOL scrub; /* cached data is checked by exfat_scrub() */
+	time_t last_scrub;
 };
 
-struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
+static ULONG get_cache_policy(const char* options)
+{
+	const char* p = exfat_get_option(options, "cache_policy");
+
+	if (p == NULL || exfat_match_value(p, "slru"))
+		return DIOCP_SLRU;
+	if (exfat_match_value(p, "arc"))
+		return DIOCP_ARC;
+	exfat_warn("unknown cache policy, using slru");
+	return DIOCP_SLRU;
+}
+
+static ULONG get_cache_verify(const char* options)
+{
+	const char* p = exfat_get_option(options, "cache_verify");
+
+	if (p == NULL || exfat_match_value(p, "always"))
+		return DIOCV_ALWAYS;
+	if (exfat_match_value(p, "never"))
+		return DIOCV_NEVER;
+	if (exfat_match_value(p, "sampled"))
+		return DIOCV_SAMPLED;
+	if (exfat_match_value(p, "scrub"))
+		return DIOCV_SCRUB;
+	exfat_warn("unknown cache verification mode, using always");
+	return DIOCV_ALWAYS;
+}
+
+/*
+ * Translates the cache options of the mount control string into libdiskio
+ * setup tags and returns their number. Options that are not given keep the
+ * defaults of DIO_Setup().
+ */
+static int get_cache_tags(struct exfat_dev* dev, const char* options,
+		struct TagItem* tags)
+{
+	const ULONG verify = get_cache_verify(options);
+	int n = 0;
+
+	dev->scrub = verify == DIOCV_SCRUB;
+	tags[n].ti_Tag = DIOS_CachePolicy;
+	tags[n++].ti_Data = get_cache_policy(options);
+	tags[n].ti_Tag = DIOS_CacheVerify;
+	tags[n++].ti_Data = verify;
+	tags[n].ti_Tag = DIOS_VerifyPeriod;
+	tags[n++].ti_Data = exfat_get_int_option(options, "verify_period", 10, 16);
+	tags[n].ti_Tag = DIOS_WriteBackAge;
+	tags[n++].ti_Data = exfat_get_int_option(options, "writeback_age", 10, 5);
+	tags[n].ti_Tag = DIOS_CachePageSize;
+	tags[n++].ti_Data = exfat_get_int_option(options, "cache_page_size", 10,
+			4096);
+	return n;
+}
+
+struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode,
+		const char* options)
 {
 	struct exfat_dev* dev;
 	ULONG disk_present, write_protected, disk_ok, sector_size;
 	UQUAD total_sectors;
+	struct TagItem tags[8];
+	int n = 0;
 
 	dev = malloc(sizeof(struct exfat_dev));
 	if (dev == NULL)
@@ -34,17 +93,18 @@ struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
 
 	dev->name = spec;
 #ifdef __AROS__
-	if (strcmp(EXEC_NAME, "exfat-handler") == 0) {
+	if (strcmp(EXEC_NAME, "exfat-handler") != 0) {
 #else
-	if (strcmp(EXEC_NAME, "exFATFileSystem") == 0) {
+	if (strcmp(EXEC_NAME, "exFATFileSystem") != 0) {
 #endif
-		dev->diskio = DIO_Setup((CONST_STRPTR)spec, NULL);
-	} else {
-		dev->diskio = DIO_SetupTags((CONST_STRPTR)spec,
-			DIOS_DOSType, ID_EXFAT_DISK,
-			DIOS_Inhibit, TRUE,
-			TAG_END);
+		tags[n].ti_Tag = DIOS_DOSType;
+		tags[n++].ti_Data = ID_EXFAT_DISK;
+		tags[n].ti_Tag = DIOS_Inhibit;
+		tags[n++].ti_Data = TRUE;
 	}
+	n += get_cache_tags(dev, options, &tags[n]);
+	tags[n].ti_Tag = TAG_END;
+	dev->diskio = DIO_Setup((CONST_STRPTR)spec, tags);
 	if (dev->diskio == NULL)
 	{
 		errno = ENODEV;
@@ -114,6 +174,41 @@ int exfat_fsync(struct exfat_dev* dev)
 	return 0;
 }
 
+/* writes a little of the data that has been dirty for a while, if any */
+int exfat_writeback(struct exfat_dev* dev)
+{
+	if (!dev->read_only) {
+		if (DIO_WriteBackIOCache(dev->diskio) != 0) {
+			debugf("Failed to write back cache of device %s\n", dev->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* checks all cached data for corruption every interval seconds */
+int exfat_scrub(struct exfat_dev* dev, time_t interval)
+{
+	const time_t now = time(NULL);
+
+	if (dev->scrub && now - dev->last_scrub >= interval) {
+		dev->last_scrub = now;
+		if (DIO_ScrubIOCache(dev->diskio) != 0) {
+			debugf("Failed to scrub cache of device %s\n", dev->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int exfat_set_direct_io(struct exfat_dev* dev)
+{
+	/* the sector cache is configured by the handler, not per mount */
+	return -ENOTSUP;
+}
+
 enum exfat_mode exfat_get_mode(const struct exfat_dev* dev)
 {
 	return dev->read_only ? EXFAT_MODE_RO : EXFAT_MODE_RW;
@@ -155,15 +250,28 @@ error:
 	return -1;
 }
 
-static int amiga_read(struct exfat_dev* dev, QUAD offset, void* buffer, size_t count) {
-	if (DIO_ReadBytes(dev->diskio, offset, buffer, count) != 0)
+static ULONG amiga_hint(enum exfat_io_hint hint) {
+	switch (hint) {
+	case EXFAT_IO_METADATA:
+		return DIOCH_METADATA;
+	case EXFAT_IO_DATA:
+		return DIOCH_DATA;
+	default:
+		return DIOCH_DEFAULT;
+	}
+}
+
+static int amiga_read(struct exfat_dev* dev, QUAD offset, void* buffer, size_t count,
+	enum exfat_io_hint hint) {
+	if (DIO_ReadBytesHint(dev->diskio, offset, buffer, count, amiga_hint(hint)) != 0)
 		return ESPIPE;
 	else
 		return 0;
 }
 
-static int amiga_write(struct exfat_dev* dev, QUAD offset, const void* buffer, size_t count) {
-	if (DIO_WriteBytes(dev->diskio, offset, buffer, count) != 0)
+static int amiga_write(struct exfat_dev* dev, QUAD offset, const void* buffer, size_t count,
+	enum exfat_io_hint hint) {
+	if (DIO_WriteBytesHint(dev->diskio, offset, buffer, count, amiga_hint(hint)) != 0)
 		return ESPIPE;
 	else
 		return 0;
@@ -171,7 +279,7 @@ static int amiga_write(struct exfat_dev* dev, QUAD offset, const void* buffer, s
 
 ssize_t exfat_read(struct exfat_dev* dev, void* buffer, size_t size)
 {
-	errno = amiga_read(dev, dev->byte_pos, buffer, size);
+	errno = amiga_read(dev, dev->byte_pos, buffer, size, EXFAT_IO_DEFAULT);
 	if (errno) goto error;
 
 	dev->byte_pos += size;
@@ -190,7 +298,7 @@ ssize_t exfat_write(struct exfat_dev* dev, const void* buffer, size_t size)
 	}
 	dev->dirty = TRUE;
 
-	errno = amiga_write(dev, dev->byte_pos, buffer, size);
+	errno = amiga_write(dev, dev->byte_pos, buffer, size, EXFAT_IO_DEFAULT);
 	if (errno) goto error;
 
 	dev->byte_pos += size;
@@ -204,7 +312,20 @@ error:
 ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 		fbx_off_t offset)
 {
-	errno = amiga_read(dev, offset, buffer, size);
+	return exfat_pread_hint(dev, buffer, size, offset, EXFAT_IO_DEFAULT);
+}
+
+ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
+		fbx_off_t offset)
+{
+	return exfat_pwrite_hint(dev, buffer, size, offset, EXFAT_IO_DEFAULT);
+}
+
+/* the hint lets libdiskio keep metadata cached while file data streams by */
+ssize_t exfat_pread_hint(struct exfat_dev* dev, void* buffer, size_t size,
+		fbx_off_t offset, enum exfat_io_hint hint)
+{
+	errno = amiga_read(dev, offset, buffer, size, hint);
 	if (errno) goto error;
 
 	return size;
@@ -213,8 +334,8 @@ error:
 	return -1;
 }
 
-ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
-		fbx_off_t offset)
+ssize_t exfat_pwrite_hint(struct exfat_dev* dev, const void* buffer,
+		size_t size, fbx_off_t offset, enum exfat_io_hint hint)
 {
 	if (dev->read_only) {
 		errno = EROFS;
@@ -222,7 +343,7 @@ ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 	}
 	dev->dirty = TRUE;
 
-	errno = amiga_write(dev, offset, buffer, size);
+	errno = amiga_write(dev, offset, buffer, size, hint);
 	if (errno) goto error;
 
 	return size;
@@ -231,96 +352,47 @@ error:
 	return -1;
 }
 
-ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
-		void* buffer, size_t size, fbx_off_t offset)
+int exfat_pread_batch(struct exfat_dev* dev, const struct exfat_io* ios,
+		int count, enum exfat_io_hint hint)
 {
-	cluster_t cluster;
-	char* bufp = buffer;
-	fbx_off_t lsize, loffset, remainder;
+	int i;
 
-	if (offset >= node->size)
-		return 0;
-	if (size == 0)
-		return 0;
+	for (i = 0; i < count; i++)
+		if (exfat_pread_hint(dev, ios[i].buffer, ios[i].size, ios[i].offset,
+				hint) < 0)
+			return -1;
 
-	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
-	if (CLUSTER_INVALID(cluster))
-	{
-		exfat_error("invalid cluster 0x%x while reading", cluster);
-		return -1;
-	}
+	return 0;
+}
 
-	loffset = offset % CLUSTER_SIZE(*ef->sb);
-	remainder = MIN(size, node->size - offset);
-	while (remainder > 0)
-	{
-		if (CLUSTER_INVALID(cluster))
-		{
-			exfat_error("invalid cluster 0x%x while reading", cluster);
-			return -1;
-		}
-		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
-		if (exfat_pread(ef->dev, bufp, lsize,
-					exfat_c2o(ef, cluster) + loffset) < 0)
-		{
-			exfat_error("failed to read cluster %#x", cluster);
+int exfat_pwrite_batch(struct exfat_dev* dev, const struct exfat_io* ios,
+		int count, enum exfat_io_hint hint)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (exfat_pwrite_hint(dev, ios[i].buffer, ios[i].size, ios[i].offset,
+				hint) < 0)
 			return -1;
-		}
-		bufp += lsize;
-		loffset = 0;
-		remainder -= lsize;
-		cluster = exfat_next_cluster(ef, node, cluster);
-	}
-	if (!ef->ro && !ef->noatime)
-		exfat_update_atime(node);
-	return MIN(size, node->size - offset) - remainder;
+
+	return 0;
 }
 
-ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
-		const void* buffer, size_t size, fbx_off_t offset)
+/* only data that lies within one cache page can be accessed in place */
+const void* exfat_pmap(struct exfat_dev* dev, size_t size, fbx_off_t offset)
 {
-	cluster_t cluster;
-	const char* bufp = buffer;
-	fbx_off_t lsize, loffset, remainder;
-
- 	if (offset > node->size)
- 		if (exfat_truncate(ef, node, offset, true) != 0)
- 			return -1;
-  	if (offset + size > node->size)
- 		if (exfat_truncate(ef, node, offset + size, false) != 0)
- 			return -1;
-	if (size == 0)
-		return 0;
+	ULONG boffs = offset % dev->sector_size;
+	const UBYTE* data;
 
-	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
-	if (CLUSTER_INVALID(cluster))
-	{
-		exfat_error("invalid cluster 0x%x while writing", cluster);
-		return -1;
-	}
+	data = DIO_GetBlocks(dev->diskio, offset / dev->sector_size,
+		(boffs + size + dev->sector_size - 1) / dev->sector_size);
+	if (data == NULL)
+		return NULL;
 
-	loffset = offset % CLUSTER_SIZE(*ef->sb);
-	remainder = size;
-	while (remainder > 0)
-	{
-		if (CLUSTER_INVALID(cluster))
-		{
-			exfat_error("invalid cluster 0x%x while writing", cluster);
-			return -1;
-		}
-		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
-		if (exfat_pwrite(ef->dev, bufp, lsize,
-				exfat_c2o(ef, cluster) + loffset) < 0)
-		{
-			exfat_error("failed to write cluster %#x", cluster);
-			return -1;
-		}
-		bufp += lsize;
-		loffset = 0;
-		remainder -= lsize;
-		cluster = exfat_next_cluster(ef, node, cluster);
-	}
-	exfat_update_mtime(node);
-	return size - remainder;
+	return data + boffs;
 }
 
+void exfat_punmap(struct exfat_dev* dev, const void* ptr, size_t size)
+{
+	DIO_ReleaseBlocks(dev->diskio, ptr);
+}
@@ -25,6 +25,23 @@
 #include <string.h>
 #include <inttypes.h>
 
+/* the heap is divided into groups of this size whose free clusters are
+   counted, so that allocation policies need not scan the whole bitmap */
+#define ALLOC_GROUP_SIZE (4 * 1024 * 1024)
+/* the best-fit policy looks for a free run in this many groups starting at
+   the allocation cursor */
+#define BEST_FIT_GROUPS 64
+/* the locality allocation policy puts each new directory into the emptiest
+   group and places files up to LOCALITY_SIZE_MAX next to their directory,
+   with room for LOCALITY_WINDOW_SIZE; larger files go to the emptiest group */
+#define LOCALITY_SIZE_MAX (256 * 1024)
+#define LOCALITY_WINDOW_SIZE (64 * 1024)
+/* number of bytes reserved after the end of a file that is being appended to,
+   so that concurrent writers do not interleave their clusters */
+#define RESERVATION_SIZE (1024 * 1024)
+/* maximum size of one transfer when a file is moved by exfat_defragment() */
+#define DEFRAG_BUFFER_SIZE (256 * 1024)
+
 /*
  * Sector to absolute offset.
  */
@@ -75,6 +92,7 @@ cluster_t exfat_next_cluster(const struct exfat* ef,
 {
 	le32_t next;
 	fbx_off_t fat_offset;
+	const void* entry;
 
 	if (cluster < EXFAT_FIRST_DATA_CLUSTER)
 		exfat_bug("bad cluster 0x%x", cluster);
@@ -83,7 +101,14 @@ cluster_t exfat_next_cluster(const struct exfat* ef,
 		return cluster + 1;
 	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
 		+ cluster * sizeof(cluster_t);
-	if (exfat_pread(ef->dev, &next, sizeof(next), fat_offset) < 0)
+	entry = exfat_pmap(ef->dev, sizeof(next), fat_offset);
+	if (entry != NULL)
+	{
+		memcpy(&next, entry, sizeof(next));
+		exfat_punmap(ef->dev, entry, sizeof(next));
+	}
+	else if (exfat_pread_hint(ef->dev, &next, sizeof(next), fat_offset,
+			EXFAT_IO_METADATA) < 0)
 		return EXFAT_CLUSTER_BAD; /* the caller should handle this and print
 		                             appropriate error message */
 	return le32_to_cpu(next);
@@ -146,25 +171,66 @@ static int flush_nodes(struct exfat* ef, struct exfat_node* node)
 		if (rc != 0)
 			return rc;
 	}
+	if (node->flags & EXFAT_ATTRIB_SHRINK)
+	{
+		int rc;
+
+		/* the directory may have no references but it is changed here */
+		exfat_get_node(node);
+		rc = exfat_shrink_directory(ef, node);
+		if (rc == 0)
+			rc = exfat_flush_node(ef, node);
+		exfat_put_node(ef, node);
+		return rc;
+	}
 	return exfat_flush_node(ef, node);
 }
 
 int exfat_flush_nodes(struct exfat* ef)
 {
+	int rc = exfat_flush_times(ef, 0);
+
+	if (rc != 0)
+		return rc;
 	return flush_nodes(ef, ef->root);
 }
 
+/* marks all reserved clusters in the bitmap as used or free */
+static void mark_reservations(struct exfat* ef, bool used)
+{
+	const struct exfat_node* p;
+	cluster_t c;
+
+	for (p = ef->reserving; p != NULL; p = p->reserve_next)
+		for (c = p->reserve_start; c < p->reserve_start + p->reserve_count;
+				c++)
+			if (used)
+				BMAP_SET(ef->cmap.chunk, c - EXFAT_FIRST_DATA_CLUSTER);
+			else
+				BMAP_CLR(ef->cmap.chunk, c - EXFAT_FIRST_DATA_CLUSTER);
+}
+
 int exfat_flush(struct exfat* ef)
 {
 	if (ef->cmap.dirty)
 	{
-		if (exfat_pwrite(ef->dev, ef->cmap.chunk,
+		int rc = 0;
+
+		/* reservations exist only in memory */
+		if (ef->reserved_clusters != 0)
+			mark_reservations(ef, false);
+		if (exfat_pwrite_hint(ef->dev, ef->cmap.chunk,
 				BMAP_SIZE(ef->cmap.chunk_size),
-				exfat_c2o(ef, ef->cmap.start_cluster)) < 0)
+				exfat_c2o(ef, ef->cmap.start_cluster),
+				EXFAT_IO_METADATA) < 0)
 		{
 			exfat_error("failed to write clusters bitmap");
-			return -EIO;
+			rc = -EIO;
 		}
+		if (ef->reserved_clusters != 0)
+			mark_reservations(ef, true);
+		if (rc != 0)
+			return rc;
 		ef->cmap.dirty = false;
 	}
 
@@ -182,7 +248,8 @@ static bool set_next_cluster(const struct exfat* ef, bool contiguous,
 	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
 		+ current * sizeof(cluster_t);
 	next_le32 = cpu_to_le32(next);
-	if (exfat_pwrite(ef->dev, &next_le32, sizeof(next_le32), fat_offset) < 0)
+	if (exfat_pwrite_hint(ef->dev, &next_le32, sizeof(next_le32), fat_offset,
+			EXFAT_IO_METADATA) < 0)
 	{
 		exfat_error("failed to write the next cluster %#x after %#x", next,
 				current);
@@ -191,6 +258,128 @@ static bool set_next_cluster(const struct exfat* ef, bool contiguous,
 	return true;
 }
 
+/*
+ * Returns the number of clusters in an allocation group. Groups consist of
+ * whole bitmap words.
+ */
+static size_t group_clusters(const struct exfat* ef)
+{
+	const size_t bits = sizeof(bitmap_t) * 8;
+
+	return ROUND_UP(MAX(1, ALLOC_GROUP_SIZE / CLUSTER_SIZE(*ef->sb)), bits);
+}
+
+/*
+ * Counts free clusters of every allocation group. The counts are kept up to
+ * date from then on, until the volume is unmounted.
+ */
+static int count_groups(struct exfat* ef)
+{
+	const size_t bits = sizeof(bitmap_t) * 8;
+	const size_t size = group_clusters(ef);
+	const size_t groups = DIV_ROUND_UP(ef->cmap.chunk_size, size);
+	size_t i;
+	size_t c;
+
+	ef->cmap.group_free = calloc(groups, sizeof(uint32_t));
+	if (ef->cmap.group_free == NULL)
+	{
+		exfat_error("failed to allocate memory for allocation groups");
+		return -ENOMEM;
+	}
+	for (i = 0; i < ef->cmap.chunk_size; i += bits)
+	{
+		const bitmap_t word = ef->cmap.chunk[BMAP_BLOCK(i)];
+
+		if (word == 0 && i + bits <= ef->cmap.chunk_size)
+			ef->cmap.group_free[i / size] += bits;
+		else if (word != (bitmap_t) ~0)
+			for (c = i; c < MIN(i + bits, ef->cmap.chunk_size); c++)
+				if (BMAP_GET(ef->cmap.chunk, c) == 0)
+					ef->cmap.group_free[i / size]++;
+	}
+	return 0;
+}
+
+/*
+ * Adds count clusters starting at bitmap index first to the free counts of
+ * their groups (or subtracts them if the clusters were taken).
+ */
+static void update_groups(struct exfat* ef, size_t first, size_t count,
+		bool freed)
+{
+	const size_t size = group_clusters(ef);
+
+	if (ef->cmap.group_free == NULL)
+		return;
+	while (count != 0)
+	{
+		const size_t n = MIN(count, size - first % size);
+
+		if (freed)
+			ef->cmap.group_free[first / size] += n;
+		else
+			ef->cmap.group_free[first / size] -= n;
+		first += n;
+		count -= n;
+	}
+}
+
+/* marks clusters [first, first + count) as free in the bitmap */
+static void free_clusters(struct exfat* ef, cluster_t first, uint32_t count)
+{
+	const size_t bits = sizeof(bitmap_t) * 8;
+	size_t i = first - EXFAT_FIRST_DATA_CLUSTER;
+	const size_t end = i + count;
+
+	if (CLUSTER_INVALID(first))
+		exfat_bug("freeing invalid cluster 0x%x", first);
+	if (end > ef->cmap.size)
+		exfat_bug("freeing non-existing clusters 0x%x-0x%x (0x%x)", first,
+				first + count - 1, ef->cmap.size);
+
+	for (; i < end && i % bits != 0; i++)
+		BMAP_CLR(ef->cmap.chunk, i);
+	/* whole words in the middle of the range */
+	for (; i + bits <= end; i += bits)
+		ef->cmap.chunk[BMAP_BLOCK(i)] = 0;
+	for (; i < end; i++)
+		BMAP_CLR(ef->cmap.chunk, i);
+	update_groups(ef, first - EXFAT_FIRST_DATA_CLUSTER, count, true);
+	ef->cmap.dirty = true;
+}
+
+/* removes the node from the list of nodes with reserved clusters */
+static void unlink_reservation(struct exfat* ef, struct exfat_node* node)
+{
+	struct exfat_node** p;
+
+	for (p = &ef->reserving; *p != NULL; p = &(*p)->reserve_next)
+		if (*p == node)
+		{
+			*p = node->reserve_next;
+			break;
+		}
+	node->reserve_next = NULL;
+	node->reserve_start = EXFAT_CLUSTER_FREE;
+	node->reserve_count = 0;
+}
+
+void exfat_release_reservation(struct exfat* ef, struct exfat_node* node)
+{
+	if (node->reserve_count == 0)
+		return;
+	free_clusters(ef, node->reserve_start, node->reserve_count);
+	ef->reserved_clusters -= node->reserve_count;
+	unlink_reservation(ef, node);
+}
+
+static void release_reservations(struct exfat* ef)
+{
+	while (ef->reserving != NULL)
+		exfat_release_reservation(ef, ef->reserving);
+}
+
 static cluster_t allocate_cluster(struct exfat* ef, cluster_t hint)
 {
 	cluster_t cluster;
@@ -202,26 +391,233 @@ static cluster_t allocate_cluster(struct exfat* ef, cluster_t hint)
 	cluster = find_bit_and_set(ef->cmap.chunk, hint, ef->cmap.chunk_size);
 	if (cluster == EXFAT_CLUSTER_END)
 		cluster = find_bit_and_set(ef->cmap.chunk, 0, hint);
+	if (cluster == EXFAT_CLUSTER_END && ef->reclaim != NULL)
+	{
+		/* clusters of unlinked nodes are not freed yet, do it now */
+		exfat_reclaim(ef, UINT32_MAX);
+		cluster = find_bit_and_set(ef->cmap.chunk, 0, ef->cmap.chunk_size);
+	}
+	if (cluster == EXFAT_CLUSTER_END && ef->reserved_clusters != 0)
+	{
+		/* free space is better spent fragmented than not at all */
+		release_reservations(ef);
+		cluster = find_bit_and_set(ef->cmap.chunk, 0, ef->cmap.chunk_size);
+	}
 	if (cluster == EXFAT_CLUSTER_END)
 	{
 		exfat_error("no free space left");
 		return EXFAT_CLUSTER_END;
 	}
 
+	update_groups(ef, cluster - EXFAT_FIRST_DATA_CLUSTER, 1, false);
 	ef->cmap.dirty = true;
+	ef->alloc_cursor = cluster + 1;
 	return cluster;
 }
 
-static void free_cluster(struct exfat* ef, cluster_t cluster)
+/*
+ * Returns the start of the smallest free run of at least count clusters
+ * that begins at bitmap index [from, to) or, if there is no such run, of the
+ * largest one. The run length is stored in size. Groups that are counted as
+ * full or empty are passed over without looking at their bits.
+ */
+static cluster_t find_best_fit(const struct exfat* ef, size_t from,
+		size_t to, uint32_t count, uint32_t* size)
 {
-	if (CLUSTER_INVALID(cluster))
-		exfat_bug("freeing invalid cluster 0x%x", cluster);
-	if (cluster - EXFAT_FIRST_DATA_CLUSTER >= ef->cmap.size)
-		exfat_bug("freeing non-existing cluster 0x%x (0x%x)", cluster,
-				ef->cmap.size);
+	const size_t bits = sizeof(bitmap_t) * 8;
+	const size_t group = group_clusters(ef);
+	const bitmap_t* bitmap = ef->cmap.chunk;
+	size_t i = from;
+	size_t best = 0;
+	size_t best_size = 0;
 
-	BMAP_CLR(ef->cmap.chunk, cluster - EXFAT_FIRST_DATA_CLUSTER);
-	ef->cmap.dirty = true;
+	to = MIN(to, ef->cmap.chunk_size);
+	while (i < to)
+	{
+		size_t start;
+		size_t end;
+
+		if (i % group == 0 && ef->cmap.group_free != NULL &&
+				ef->cmap.group_free[i / group] == 0)
+		{
+			i += group;
+			continue;
+		}
+		if (i % bits == 0 && bitmap[BMAP_BLOCK(i)] == (bitmap_t) ~0)
+		{
+			i += bits;
+			continue;
+		}
+		if (BMAP_GET(bitmap, i))
+		{
+			i++;
+			continue;
+		}
+		start = i;
+		/* a run that leaves the range is measured only as far as needed */
+		end = MIN(ef->cmap.chunk_size, MAX(to, start + count));
+		while (i < end && BMAP_GET(bitmap, i) == 0)
+		{
+			if (i % group == 0 && i + group <= end &&
+					ef->cmap.group_free != NULL &&
+					ef->cmap.group_free[i / group] == group)
+				i += group;
+			else if (i % bits == 0 && i + bits <= end &&
+					bitmap[BMAP_BLOCK(i)] == 0)
+				i += bits;
+			else
+				i++;
+		}
+		if (i - start >= count ?
+				best_size < count || i - start < best_size :
+				i - start > best_size)
+		{
+			best = start;
+			best_size = i - start;
+			if (best_size == count)
+				break;
+		}
+	}
+	*size = best_size;
+	return best + EXFAT_FIRST_DATA_CLUSTER;
+}
+
+/*
+ * Looks for the best fitting run of count clusters in BEST_FIT_GROUPS groups
+ * starting at the allocation cursor, wrapping around at the end of the heap.
+ */
+static cluster_t find_best_fit_near_cursor(const struct exfat* ef,
+		uint32_t count)
+{
+	const size_t group = group_clusters(ef);
+	const size_t window = group * BEST_FIT_GROUPS;
+	size_t from = ef->alloc_cursor - EXFAT_FIRST_DATA_CLUSTER;
+	cluster_t best;
+	cluster_t wrapped;
+	uint32_t size;
+	uint32_t wrapped_size;
+
+	if (from >= ef->cmap.chunk_size)
+		from = 0;
+	from -= from % group;
+	best = find_best_fit(ef, from, from + window, count, &size);
+	if (size == count || from + window <= ef->cmap.chunk_size)
+		return best;
+	wrapped = find_best_fit(ef, 0,
+			MIN(from, from + window - ef->cmap.chunk_size), count,
+			&wrapped_size);
+	if (wrapped_size >= count ?
+			size < count || wrapped_size < size :
+			wrapped_size > size)
+		return wrapped;
+	return best;
+}
+
+/*
+ * Returns the first cluster of the allocation group with most free clusters.
+ */
+static cluster_t find_emptiest_group(const struct exfat* ef)
+{
+	const size_t size = group_clusters(ef);
+	const size_t groups = DIV_ROUND_UP(ef->cmap.chunk_size, size);
+	size_t best = 0;
+	size_t i;
+
+	for (i = 1; i < groups; i++)
+		if (ef->cmap.group_free[i] > ef->cmap.group_free[best])
+			best = i;
+	return best * size + EXFAT_FIRST_DATA_CLUSTER;
+}
+
+/*
+ * Returns the start of the first free run of at least count clusters that
+ * begins at bitmap index [from, to), or the cluster at from if there is no
+ * such run.
+ */
+static cluster_t find_first_fit(const struct exfat* ef, size_t from,
+		size_t to, uint32_t count)
+{
+	const size_t bits = sizeof(bitmap_t) * 8;
+	const bitmap_t* bitmap = ef->cmap.chunk;
+	size_t i = from;
+
+	to = MIN(to, ef->cmap.chunk_size);
+	while (i < to)
+	{
+		size_t start;
+		size_t end;
+
+		if (i % bits == 0 && bitmap[BMAP_BLOCK(i)] == (bitmap_t) ~0)
+		{
+			i += bits;
+			continue;
+		}
+		if (BMAP_GET(bitmap, i))
+		{
+			i++;
+			continue;
+		}
+		start = i;
+		end = MIN(ef->cmap.chunk_size, start + count);
+		while (i < end && BMAP_GET(bitmap, i) == 0)
+		{
+			if (i % bits == 0 && i + bits <= end &&
+					bitmap[BMAP_BLOCK(i)] == 0)
+				i += bits;
+			else
+				i++;
+		}
+		if (i - start >= count)
+			return start + EXFAT_FIRST_DATA_CLUSTER;
+	}
+	return from + EXFAT_FIRST_DATA_CLUSTER;
+}
+
+/*
+ * Chooses where allocation of the first clusters of an empty node starts.
+ * The first request is usually only the first write, so the best and
+ * locality policies look for a run that has room for more. Its size is
+ * stored in window, and grow_file() reserves the rest of it at once. The
+ * window is 0 if the policy does not look for room.
+ */
+static cluster_t first_cluster_hint(struct exfat* ef,
+		const struct exfat_node* node, uint32_t count, uint32_t* window)
+{
+	const uint32_t cluster_size = CLUSTER_SIZE(*ef->sb);
+
+	*window = 0;
+	if ((ef->alloc_policy == EXFAT_ALLOC_BEST ||
+			ef->alloc_policy == EXFAT_ALLOC_LOCALITY) &&
+			ef->cmap.group_free == NULL && count_groups(ef) != 0)
+		return ef->alloc_cursor;
+
+	switch (ef->alloc_policy)
+	{
+	case EXFAT_ALLOC_NEXT:
+		return ef->alloc_cursor;
+	case EXFAT_ALLOC_BEST:
+		if (node->flags & EXFAT_ATTRIB_DIR)
+			return find_best_fit_near_cursor(ef, count);
+		*window = MAX(count, RESERVATION_SIZE / cluster_size);
+		return find_best_fit_near_cursor(ef, *window);
+	case EXFAT_ALLOC_LOCALITY:
+		if (node->flags & EXFAT_ATTRIB_DIR)
+			return find_emptiest_group(ef);
+		/* large files go elsewhere to leave room for the small ones */
+		if (node->parent == NULL ||
+				(uint64_t) count * cluster_size > LOCALITY_SIZE_MAX)
+		{
+			*window = MAX(count, RESERVATION_SIZE / cluster_size);
+			return find_emptiest_group(ef);
+		}
+		*window = MAX(count, LOCALITY_WINDOW_SIZE / cluster_size);
+		return find_first_fit(ef,
+				node->parent->start_cluster - EXFAT_FIRST_DATA_CLUSTER,
+				node->parent->start_cluster - EXFAT_FIRST_DATA_CLUSTER +
+				group_clusters(ef), *window);
+	default:
+		return 0;
+	}
 }
 
 static bool make_noncontiguous(const struct exfat* ef, cluster_t first,
@@ -235,6 +631,109 @@ static bool make_noncontiguous(const struct exfat* ef, cluster_t first,
 	return true;
 }
 
+/*
+ * Frees count clusters of the node's chain starting at *cluster, run by run,
+ * and leaves *cluster pointing to the cluster after them. FAT entries of free
+ * clusters have no meaning, so they are left as they are.
+ */
+static int free_chain(struct exfat* ef, const struct exfat_node* node,
+		cluster_t* cluster, uint32_t count)
+{
+	if (IS_CONTIGUOUS(*node))
+	{
+		free_clusters(ef, *cluster, count);
+		*cluster += count;
+		return 0;
+	}
+	while (count != 0)
+	{
+		const cluster_t first = *cluster;
+		uint32_t run = 0;
+
+		do
+		{
+			if (CLUSTER_INVALID(*cluster))
+			{
+				exfat_error("invalid cluster 0x%x while freeing", *cluster);
+				return -EIO;
+			}
+			*cluster = exfat_next_cluster(ef, node, *cluster);
+			run++;
+			count--;
+		}
+		while (count != 0 && *cluster == first + run);
+		free_clusters(ef, first, run);
+	}
+	return 0;
+}
+
+/*
+ * Allocates the cluster to follow the previous one, taking it from the node's
+ * reservation if that continues the file.
+ */
+static cluster_t allocate_next(struct exfat* ef, struct exfat_node* node,
+		cluster_t previous)
+{
+	if (node->reserve_count != 0)
+	{
+		if (node->reserve_start == previous + 1)
+		{
+			node->reserve_start++;
+			node->reserve_count--;
+			ef->reserved_clusters--;
+			if (node->reserve_count == 0)
+				unlink_reservation(ef, node);
+			return previous + 1;
+		}
+		exfat_release_reservation(ef, node);
+	}
+	return allocate_cluster(ef, previous + 1);
+}
+
+/*
+ * Reserves up to max free clusters that directly follow the last cluster of
+ * the node.
+ */
+static void reserve_clusters(struct exfat* ef, struct exfat_node* node,
+		cluster_t last, uint32_t max)
+{
+	size_t i = last + 1 - EXFAT_FIRST_DATA_CLUSTER;
+	uint32_t count = 0;
+
+	while (count < max && i + count < ef->cmap.chunk_size &&
+			BMAP_GET(ef->cmap.chunk, i + count) == 0)
+	{
+		BMAP_SET(ef->cmap.chunk, i + count);
+		count++;
+	}
+	if (count == 0)
+		return;
+	update_groups(ef, i, count, false);
+	node->reserve_start = last + 1;
+	node->reserve_count = count;
+	node->reserve_next = ef->reserving;
+	ef->reserving = node;
+	ef->reserved_clusters += count;
+	ef->cmap.dirty = true;
+}
+
+/*
+ * Tells whether a file that the locality policy placed next to its directory
+ * grows beyond LOCALITY_SIZE_MAX with this request.
+ */
+static bool outgrows_locality(const struct exfat* ef,
+		const struct exfat_node* node, uint32_t current, uint32_t difference)
+{
+	const uint64_t cluster_size = CLUSTER_SIZE(*ef->sb);
+
+	return ef->alloc_policy == EXFAT_ALLOC_LOCALITY &&
+			ef->cmap.group_free != NULL &&
+			!(node->flags & EXFAT_ATTRIB_DIR) &&
+			current != 0 &&
+			current * cluster_size <= LOCALITY_SIZE_MAX &&
+			(current + difference) * cluster_size > LOCALITY_SIZE_MAX;
+}
+
 static int shrink_file(struct exfat* ef, struct exfat_node* node,
 		uint32_t current, uint32_t difference);
 
@@ -244,6 +743,7 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 	cluster_t previous;
 	cluster_t next;
 	uint32_t allocated = 0;
+	uint32_t window = 0;
 
 	if (difference == 0)
 		exfat_bug("zero clusters count passed");
@@ -264,7 +764,8 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 			exfat_bug("non-zero pointer index (%u)", node->fptr_index);
 		/* file does not have clusters (i.e. is empty), allocate
 		   the first one for it */
-		previous = allocate_cluster(ef, 0);
+		previous = allocate_cluster(ef,
+				first_cluster_hint(ef, node, difference, &window));
 		if (CLUSTER_INVALID(previous))
 			return -ENOSPC;
 		node->fptr_cluster = node->start_cluster = previous;
@@ -275,14 +776,22 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 
 	while (allocated < difference)
 	{
-		next = allocate_cluster(ef, previous + 1);
+		if (allocated == 0 && outgrows_locality(ef, node, current, difference))
+		{
+			/* the file is not small after all, leave the room next to its
+			   directory to small files */
+			exfat_release_reservation(ef, node);
+			next = allocate_cluster(ef, find_emptiest_group(ef));
+		}
+		else
+			next = allocate_next(ef, node, previous);
 		if (CLUSTER_INVALID(next))
 		{
 			if (allocated != 0)
 				shrink_file(ef, node, current + allocated, allocated);
 			return -ENOSPC;
 		}
-		if (next != previous - 1 && IS_CONTIGUOUS(*node))
+		if (next != previous + 1 && IS_CONTIGUOUS(*node))
 		{
 			/* it's a pity, but we are not able to keep the file contiguous
 			   anymore */
@@ -300,6 +809,12 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 	if (!set_next_cluster(ef, IS_CONTIGUOUS(*node), previous,
 			EXFAT_CLUSTER_END))
 		return -EIO;
+	/* a file that grows again is being appended to, keep room for it */
+	if (current != 0)
+		window = difference + MAX(1, RESERVATION_SIZE / CLUSTER_SIZE(*ef->sb));
+	if (window > difference && node->reserve_count == 0 &&
+			!(node->flags & EXFAT_ATTRIB_DIR))
+		reserve_clusters(ef, node, previous, window - difference);
 	return 0;
 }
 
@@ -307,7 +822,6 @@ static int shrink_file(struct exfat* ef, struct exfat_node* node,
 		uint32_t current, uint32_t difference)
 {
 	cluster_t previous;
-	cluster_t next;
 
 	if (difference == 0)
 		exfat_bug("zero difference passed");
@@ -316,6 +830,9 @@ static int shrink_file(struct exfat* ef, struct exfat_node* node,
 	if (current < difference)
 		exfat_bug("file underflow (%u < %u)", current, difference);
 
+	/* the reservation would not follow the end of the file anymore */
+	exfat_release_reservation(ef, node);
+
 	/* crop the file */
 	if (current > difference)
 	{
@@ -341,27 +858,14 @@ static int shrink_file(struct exfat* ef, struct exfat_node* node,
 	node->fptr_cluster = node->start_cluster;
 
 	/* free remaining clusters */
-	while (difference--)
-	{
-		if (CLUSTER_INVALID(previous))
-		{
-			exfat_error("invalid cluster 0x%x while freeing after shrink",
-					previous);
-			return -EIO;
-		}
-		next = exfat_next_cluster(ef, node, previous);
-		if (!set_next_cluster(ef, IS_CONTIGUOUS(*node), previous,
-				EXFAT_CLUSTER_FREE))
-			return -EIO;
-		free_cluster(ef, previous);
-		previous = next;
-	}
-	return 0;
+	return free_chain(ef, node, &previous, difference);
 }
 
-static bool erase_raw(struct exfat* ef, size_t size, fbx_off_t offset)
+static bool erase_raw(struct exfat* ef, size_t size, fbx_off_t offset,
+		enum exfat_io_hint hint)
 {
-	if (exfat_pwrite(ef->dev, ef->zero_cluster, size, offset) < 0)
+	if (exfat_pwrite_hint(ef->dev, ef->zero_cluster, size, offset,
+			hint) < 0)
 	{
 		exfat_error("failed to erase %zu bytes at %"PRId64, size, offset);
 		return false;
@@ -374,6 +878,11 @@ static int erase_range(struct exfat* ef, struct exfat_node* node,
 {
 	uint64_t cluster_boundary;
 	cluster_t cluster;
+	struct exfat_io ios[EXFAT_IO_BATCH];
+	int count = 0;
+	/* clusters of a directory hold its entries */
+	const enum exfat_io_hint hint = (node->flags & EXFAT_ATTRIB_DIR) ?
+			EXFAT_IO_METADATA : EXFAT_IO_DATA;
 
 	if (begin >= end)
 		return 0;
@@ -388,18 +897,30 @@ static int erase_range(struct exfat* ef, struct exfat_node* node,
 	}
 	/* erase from the beginning to the closest cluster boundary */
 	if (!erase_raw(ef, MIN(cluster_boundary, end) - begin,
-			exfat_c2o(ef, cluster) + begin % CLUSTER_SIZE(*ef->sb)))
+			exfat_c2o(ef, cluster) + begin % CLUSTER_SIZE(*ef->sb),
+			hint))
 		return -EIO;
-	/* erase whole clusters */
+	/* erase whole clusters, submitting them in batches */
 	while (cluster_boundary < end)
 	{
 		cluster = exfat_next_cluster(ef, node, cluster);
 		/* the cluster cannot be invalid because we have just allocated it */
 		if (CLUSTER_INVALID(cluster))
 			exfat_bug("invalid cluster 0x%x after allocation", cluster);
-		if (!erase_raw(ef, CLUSTER_SIZE(*ef->sb), exfat_c2o(ef, cluster)))
-			return -EIO;
+		ios[count].buffer = ef->zero_cluster;
+		ios[count].size = CLUSTER_SIZE(*ef->sb);
+		ios[count].offset = exfat_c2o(ef, cluster);
 		cluster_boundary += CLUSTER_SIZE(*ef->sb);
+		if (++count == EXFAT_IO_BATCH || cluster_boundary >= end)
+		{
+			if (exfat_pwrite_batch(ef->dev, ios, count, hint) != 0)
+			{
+				exfat_error("failed to erase %d clusters before %#x", count,
+						cluster);
+				return -EIO;
+			}
+			count = 0;
+		}
 	}
 	return 0;
 }
@@ -432,12 +953,211 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 			return rc;
 	}
 
-	exfat_update_mtime(node);
+	exfat_update_mtime(ef, node);
 	node->size = size;
 	node->flags |= EXFAT_ATTRIB_DIRTY;
 	return 0;
 }
 
+/*
+ * Frees clusters of unlinked nodes queued by exfat_cleanup_node(), but not
+ * more than max of them. Unlinked nodes have no directory entries, so their
+ * chains are consumed from the beginning.
+ */
+int exfat_reclaim(struct exfat* ef, uint32_t max)
+{
+	while (ef->reclaim != NULL && max != 0)
+	{
+		struct exfat_node* node = ef->reclaim;
+		const uint32_t clusters = bytes2clusters(ef, node->size);
+		const uint32_t count = MIN(clusters, max);
+		int rc;
+
+		rc = free_chain(ef, node, &node->start_cluster, count);
+		if (rc != 0 || count == clusters)
+		{
+			/* free the node even in case of error or its memory will be
+			   lost; the rest of its clusters is lost anyway */
+			ef->reclaim = node->next;
+			ef->reclaim_clusters -= clusters;
+			free(node);
+			if (rc != 0)
+				return rc;
+		}
+		else
+		{
+			node->size -= (uint64_t) count * CLUSTER_SIZE(*ef->sb);
+			ef->reclaim_clusters -= count;
+		}
+		max -= count;
+	}
+	return 0;
+}
+
+int exfat_count_fragments(const struct exfat* ef,
+		const struct exfat_node* node, uint32_t* fragments)
+{
+	const uint32_t clusters = bytes2clusters(ef, node->size);
+	cluster_t cluster = node->start_cluster;
+	uint32_t i;
+
+	*fragments = clusters != 0;
+	if (IS_CONTIGUOUS(*node))
+		return 0;
+	for (i = 1; i < clusters; i++)
+	{
+		cluster_t next;
+
+		if (CLUSTER_INVALID(cluster))
+		{
+			exfat_error("invalid cluster 0x%x while counting fragments",
+					cluster);
+			return -EIO;
+		}
+		next = exfat_next_cluster(ef, node, cluster);
+		if (next != cluster + 1)
+			(*fragments)++;
+		cluster = next;
+	}
+	return 0;
+}
+
+/*
+ * Copies count clusters of the node's chain to the contiguous run starting at
+ * target, reading and writing a run of the chain at once.
+ */
+static int copy_chain(struct exfat* ef, const struct exfat_node* node,
+		cluster_t target, uint32_t count, void* buffer)
+{
+	const uint32_t max = MAX(1, DEFRAG_BUFFER_SIZE / CLUSTER_SIZE(*ef->sb));
+	cluster_t cluster = node->start_cluster;
+
+	while (count != 0)
+	{
+		const cluster_t first = cluster;
+		uint32_t run = 0;
+		size_t size;
+
+		do
+		{
+			if (CLUSTER_INVALID(cluster))
+			{
+				exfat_error("invalid cluster 0x%x while moving", cluster);
+				return -EIO;
+			}
+			cluster = exfat_next_cluster(ef, node, cluster);
+			run++;
+		}
+		while (run < count && run < max && cluster == first + run);
+
+		size = (size_t) run * CLUSTER_SIZE(*ef->sb);
+		if (exfat_pread_hint(ef->dev, buffer, size, exfat_c2o(ef, first),
+				EXFAT_IO_DATA) < 0)
+		{
+			exfat_error("failed to read clusters %#x-%#x", first,
+					first + run - 1);
+			return -EIO;
+		}
+		if (exfat_pwrite_hint(ef->dev, buffer, size, exfat_c2o(ef, target),
+				EXFAT_IO_DATA) < 0)
+		{
+			exfat_error("failed to write clusters %#x-%#x", target,
+					target + run - 1);
+			return -EIO;
+		}
+		target += run;
+		count -= run;
+	}
+	return 0;
+}
+
+/*
+ * Moves a fragmented file to a free run that holds it entirely and makes it
+ * contiguous. The entry is switched to the copy only after the copy is on
+ * disk, so a crash leaves either the old or the new chain in place.
+ */
+int exfat_defragment(struct exfat* ef, struct exfat_node* node)
+{
+	const uint32_t clusters = bytes2clusters(ef, node->size);
+	struct exfat_node old;
+	cluster_t target;
+	cluster_t cluster;
+	uint32_t fragments;
+	uint32_t size;
+	uint32_t i;
+	void* buffer;
+	int rc;
+
+	if (ef->ro)
+		return -EROFS;
+	/* cached children point into clusters of the directory */
+	if (node->flags & EXFAT_ATTRIB_DIR)
+		return -EISDIR;
+	if (node->flags & EXFAT_ATTRIB_UNLINKED)
+		return -ENOENT;
+	if (IS_CONTIGUOUS(*node) || clusters == 0)
+		return 0;
+
+	rc = exfat_count_fragments(ef, node, &fragments);
+	if (rc != 0)
+		return rc;
+	exfat_release_reservation(ef, node);
+	if (fragments <= 1)
+	{
+		/* clusters are in order already, only the flag is missing */
+		node->flags |= EXFAT_ATTRIB_CONTIGUOUS | EXFAT_ATTRIB_DIRTY;
+		return exfat_flush_node(ef, node);
+	}
+
+	target = find_best_fit(ef, 0, ef->cmap.chunk_size, clusters, &size);
+	if (size < clusters)
+		return -ENOSPC;
+	buffer = malloc(MIN(clusters, MAX(1, DEFRAG_BUFFER_SIZE /
+			CLUSTER_SIZE(*ef->sb))) * CLUSTER_SIZE(*ef->sb));
+	if (buffer == NULL)
+	{
+		exfat_error("failed to allocate defragmentation buffer");
+		return -ENOMEM;
+	}
+	for (i = target - EXFAT_FIRST_DATA_CLUSTER;
+			i < target - EXFAT_FIRST_DATA_CLUSTER + clusters; i++)
+		BMAP_SET(ef->cmap.chunk, i);
+	update_groups(ef, target - EXFAT_FIRST_DATA_CLUSTER, clusters, false);
+	ef->cmap.dirty = true;
+
+	rc = copy_chain(ef, node, target, clusters, buffer);
+	free(buffer);
+	/* the copy and its bitmap bits must be on disk before the entry */
+	if (rc == 0)
+		rc = exfat_flush(ef);
+	if (rc == 0 && exfat_fsync(ef->dev) != 0)
+		rc = -EIO;
+	if (rc != 0)
+	{
+		free_clusters(ef, target, clusters);
+		return rc;
+	}
+
+	old = *node;
+	node->start_cluster = node->fptr_cluster = target;
+	node->fptr_index = 0;
+	node->flags |= EXFAT_ATTRIB_CONTIGUOUS | EXFAT_ATTRIB_DIRTY;
+	rc = exfat_flush_node(ef, node);
+	if (rc != 0)
+	{
+		node->start_cluster = old.start_cluster;
+		node->fptr_cluster = old.fptr_cluster;
+		node->fptr_index = old.fptr_index;
+		node->flags = old.flags | EXFAT_ATTRIB_DIRTY;
+		free_clusters(ef, target, clusters);
+		return rc;
+	}
+
+	/* FAT entries of the old chain are still intact */
+	cluster = old.start_cluster;
+	return free_chain(ef, &old, &cluster, clusters);
+}
+
 uint32_t exfat_count_free_clusters(const struct exfat* ef)
 {
 	uint32_t free_clusters = 0;
@@ -490,3 +1210,147 @@ int exfat_find_used_sectors(const struct exfat* ef, fbx_off_t* a, fbx_off_t* b)
 	*b = c2s(ef, cb) + (CLUSTER_SIZE(*ef->sb) - 1) / SECTOR_SIZE(*ef->sb);
 	return 0;
 }
+
+/*
+ * Appends a transfer to the batch. Transfers that are adjacent on disk are
+ * merged into one request. Returns false if the batch is full.
+ */
+static bool add_io(struct exfat_io* ios, int* count, void* buffer,
+		size_t size, fbx_off_t offset)
+{
+	if (*count != 0 && ios[*count - 1].offset + ios[*count - 1].size == offset)
+	{
+		ios[*count - 1].size += size;
+		return true;
+	}
+	if (*count == EXFAT_IO_BATCH)
+		return false;
+	ios[*count].buffer = buffer;
+	ios[*count].size = size;
+	ios[*count].offset = offset;
+	(*count)++;
+	return true;
+}
+
+ssize_t exfat_generic_pread(struct exfat* ef, struct exfat_node* node,
+		void* buffer, size_t size, fbx_off_t offset)
+{
+	cluster_t cluster;
+	char* bufp = buffer;
+	fbx_off_t lsize, loffset, remainder;
+	struct exfat_io ios[EXFAT_IO_BATCH];
+	int count = 0;
+
+	if (offset >= node->size)
+		return 0;
+	if (size == 0)
+		return 0;
+
+	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
+	if (CLUSTER_INVALID(cluster))
+	{
+		exfat_error("invalid cluster 0x%x while reading", cluster);
+		return -1;
+	}
+
+	loffset = offset % CLUSTER_SIZE(*ef->sb);
+	remainder = MIN(size, node->size - offset);
+	while (remainder > 0)
+	{
+		if (CLUSTER_INVALID(cluster))
+		{
+			exfat_error("invalid cluster 0x%x while reading", cluster);
+			return -1;
+		}
+		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
+		if (!add_io(ios, &count, bufp, lsize,
+				exfat_c2o(ef, cluster) + loffset))
+		{
+			if (exfat_pread_batch(ef->dev, ios, count,
+					EXFAT_IO_DATA) != 0)
+			{
+				exfat_error("failed to read clusters before %#x", cluster);
+				return -1;
+			}
+			count = 0;
+			add_io(ios, &count, bufp, lsize, exfat_c2o(ef, cluster) + loffset);
+		}
+		bufp += lsize;
+		loffset = 0;
+		remainder -= lsize;
+		cluster = exfat_next_cluster(ef, node, cluster);
+	}
+	if (count != 0 &&
+			exfat_pread_batch(ef->dev, ios, count, EXFAT_IO_DATA) != 0)
+	{
+		exfat_error("failed to read clusters before %#x", cluster);
+		return -1;
+	}
+	if (!ef->ro && !ef->noatime)
+		exfat_update_atime(ef, node);
+	return MIN(size, node->size - offset) - remainder;
+}
+
+ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
+		const void* buffer, size_t size, fbx_off_t offset)
+{
+	cluster_t cluster;
+	const char* bufp = buffer;
+	fbx_off_t lsize, loffset, remainder;
+	struct exfat_io ios[EXFAT_IO_BATCH];
+	int count = 0;
+
+ 	if (offset > node->size)
+ 		if (exfat_truncate(ef, node, offset, true) != 0)
+ 			return -1;
+  	if (offset + size > node->size)
+ 		if (exfat_truncate(ef, node, offset + size, false) != 0)
+ 			return -1;
+	if (size == 0)
+		return 0;
+
+	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
+	if (CLUSTER_INVALID(cluster))
+	{
+		exfat_error("invalid cluster 0x%x while writing", cluster);
+		return -1;
+	}
+
+	loffset = offset % CLUSTER_SIZE(*ef->sb);
+	remainder = size;
+	while (remainder > 0)
+	{
+		if (CLUSTER_INVALID(cluster))
+		{
+			exfat_error("invalid cluster 0x%x while writing", cluster);
+			return -1;
+		}
+		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
+		/* the buffer is only read by exfat_pwrite_batch() */
+		if (!add_io(ios, &count, (void*) bufp, lsize,
+				exfat_c2o(ef, cluster) + loffset))
+		{
+			if (exfat_pwrite_batch(ef->dev, ios, count,
+					EXFAT_IO_DATA) != 0)
+			{
+				exfat_error("failed to write clusters before %#x", cluster);
+				return -1;
+			}
+			count = 0;
+			add_io(ios, &count, (void*) bufp, lsize,
+					exfat_c2o(ef, cluster) + loffset);
+		}
+		bufp += lsize;
+		loffset = 0;
+		remainder -= lsize;
+		cluster = exfat_next_cluster(ef, node, cluster);
+	}
+	if (count != 0 &&
+			exfat_pwrite_batch(ef->dev, ios, count, EXFAT_IO_DATA) != 0)
+	{
+		exfat_error("failed to write clusters before %#x", cluster);
+		return -1;
+	}
+	exfat_update_mtime(ef, node);
+	return size - remainder;
+}
@@ -43,6 +43,8 @@
 #define EXFAT_ATTRIB_CACHED     0x20000
 #define EXFAT_ATTRIB_DIRTY      0x40000
 #define EXFAT_ATTRIB_UNLINKED   0x80000
+#define EXFAT_ATTRIB_SHRINK     0x100000
+#define EXFAT_ATTRIB_DIRTY_TIME 0x200000 /* only timestamps, see lazytime */
 #define IS_CONTIGUOUS(node) (((node).flags & EXFAT_ATTRIB_CONTIGUOUS) != 0)
 #define SECTOR_SIZE(sb) (1 << (sb).sector_bits)
 #define CLUSTER_SIZE(sb) (SECTOR_SIZE(sb) << (sb).spc_bits)
@@ -69,6 +71,13 @@
    be corrupted with 32-bit off_t. */
 STATIC_ASSERT(sizeof(fbx_off_t) == 8);
 
+/* run of free entries in a directory */
+struct exfat_slot
+{
+	fbx_off_t offset;
+	fbx_off_t size;
+};
+
 struct exfat_node
 {
 	struct exfat_node* parent;
@@ -85,9 +94,24 @@ struct exfat_node
 	int flags;
 	uint64_t size;
 	time_t mtime, atime;
+	struct exfat_entry meta[2]; /* copy of on-disk meta1 and meta2 entries */
+	cluster_t reserve_start; /* clusters kept free for appends, see grow_file() */
+	uint32_t reserve_count;
+	struct exfat_node* reserve_next; /* next node in exfat.reserving */
+	struct exfat_slot* slots; /* free runs of a cached directory by offset */
+	int slots_count, slots_allocated;
 	le16_t name[EXFAT_NAME_MAX + 1];
 };
 
+/* how the first cluster of a file is chosen, see the "alloc" option */
+enum exfat_alloc_policy
+{
+	EXFAT_ALLOC_FIRST,		/* lowest free cluster */
+	EXFAT_ALLOC_NEXT,		/* continue after the last allocation */
+	EXFAT_ALLOC_BEST,		/* smallest free run the file fits in */
+	EXFAT_ALLOC_LOCALITY,	/* small files next to their directory */
+};
+
 enum exfat_mode
 {
 	EXFAT_MODE_RO,
@@ -110,6 +134,7 @@ struct exfat
 		uint32_t size;				/* in bits */
 		bitmap_t* chunk;
 		uint32_t chunk_size;		/* in bits */
+		uint32_t* group_free;		/* free clusters per allocation group */
 		bool dirty;
 	}
 	cmap;
@@ -120,6 +145,15 @@ struct exfat
 	gid_t gid;
 	int ro;
 	bool noatime;
+	bool relatime;
+	bool lazytime;
+	time_t lazy_since;	/* time of the oldest unwritten timestamp update */
+	enum exfat_alloc_policy alloc_policy;
+	cluster_t alloc_cursor;	/* cluster after the last allocated one */
+	struct exfat_node* reclaim;	/* unlinked nodes with clusters to free */
+	uint32_t reclaim_clusters;	/* clusters held by these nodes */
+	struct exfat_node* reserving;	/* nodes with reserved clusters */
+	uint32_t reserved_clusters;	/* clusters reserved by these nodes */
 };
 
 /* in-core nodes iterator */
@@ -129,6 +163,31 @@ struct exfat_iterator
 	struct exfat_node* current;
 };
 
+/* what a request carries, so that a device cache can favour metadata */
+enum exfat_io_hint
+{
+	EXFAT_IO_DEFAULT,
+	EXFAT_IO_METADATA,	/* FAT, bitmap and directories */
+	EXFAT_IO_DATA,		/* contents of files */
+};
+
+/* one request of a batch, see exfat_pread_batch() */
+struct exfat_io
+{
+	void* buffer;
+	size_t size;
+	fbx_off_t offset;
+};
+
+/* maximum number of requests exfat_generic_pread/pwrite() submit at once */
+#define EXFAT_IO_BATCH 16
+/* number of clusters to free per exfat_reclaim() call in the background */
+#define EXFAT_RECLAIM_BATCH 4096
+/* timestamp updates delayed by lazytime are written after this many seconds */
+#define EXFAT_LAZYTIME_EXPIRE (60 * 60)
+/* seconds between checks of cached data with cache_verify=scrub */
+#define EXFAT_SCRUB_INTERVAL (5 * 60)
+
 struct exfat_human_bytes
 {
 	uint64_t value;
@@ -142,9 +201,13 @@ void exfat_error(const char* format, ...) PRINTF;
 void exfat_warn(const char* format, ...) PRINTF;
 void exfat_debug(const char* format, ...) PRINTF;
 
-struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode);
+struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode,
+		const char* options);
 int exfat_close(struct exfat_dev* dev);
 int exfat_fsync(struct exfat_dev* dev);
+int exfat_writeback(struct exfat_dev* dev);
+int exfat_scrub(struct exfat_dev* dev, time_t interval);
+int exfat_set_direct_io(struct exfat_dev* dev);
 enum exfat_mode exfat_get_mode(const struct exfat_dev* dev);
 fbx_off_t exfat_get_size(const struct exfat_dev* dev);
 fbx_off_t exfat_seek(struct exfat_dev* dev, fbx_off_t offset, int whence);
@@ -154,7 +217,17 @@ ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 		fbx_off_t offset);
 ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 		fbx_off_t offset);
-ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
+ssize_t exfat_pread_hint(struct exfat_dev* dev, void* buffer, size_t size,
+		fbx_off_t offset, enum exfat_io_hint hint);
+ssize_t exfat_pwrite_hint(struct exfat_dev* dev, const void* buffer,
+		size_t size, fbx_off_t offset, enum exfat_io_hint hint);
+int exfat_pread_batch(struct exfat_dev* dev, const struct exfat_io* ios,
+		int count, enum exfat_io_hint hint);
+int exfat_pwrite_batch(struct exfat_dev* dev, const struct exfat_io* ios,
+		int count, enum exfat_io_hint hint);
+const void* exfat_pmap(struct exfat_dev* dev, size_t size, fbx_off_t offset);
+void exfat_punmap(struct exfat_dev* dev, const void* ptr, size_t size);
+ssize_t exfat_generic_pread(struct exfat* ef, struct exfat_node* node,
 		void* buffer, size_t size, fbx_off_t offset);
 ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 		const void* buffer, size_t size, fbx_off_t offset);
@@ -175,8 +248,13 @@ cluster_t exfat_advance_cluster(const struct exfat* ef,
 		struct exfat_node* node, uint32_t count);
 int exfat_flush_nodes(struct exfat* ef);
 int exfat_flush(struct exfat* ef);
+int exfat_reclaim(struct exfat* ef, uint32_t max);
+void exfat_release_reservation(struct exfat* ef, struct exfat_node* node);
 int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 		bool erase);
+int exfat_count_fragments(const struct exfat* ef,
+		const struct exfat_node* node, uint32_t* fragments);
+int exfat_defragment(struct exfat* ef, struct exfat_node* node);
 uint32_t exfat_count_free_clusters(const struct exfat* ef);
 int exfat_find_used_sectors(const struct exfat* ef, fbx_off_t* a, fbx_off_t* b);
 
@@ -204,21 +282,29 @@ struct exfat_node* exfat_get_node(struct exfat_node* node);
 void exfat_put_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir);
+int exfat_shrink_directory(struct exfat* ef, struct exfat_node* dir);
 void exfat_reset_cache(struct exfat* ef);
 int exfat_flush_node(struct exfat* ef, struct exfat_node* node);
 int exfat_unlink(struct exfat* ef, struct exfat_node* node);
 int exfat_rmdir(struct exfat* ef, struct exfat_node* node);
+int exfat_remove_tree(struct exfat* ef, struct exfat_node* node);
 int exfat_mknod(struct exfat* ef, const char* path);
 int exfat_mkdir(struct exfat* ef, const char* path);
 int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path);
 void exfat_utimes(struct exfat_node* node, const struct timespec tv[2]);
-void exfat_update_atime(struct exfat_node* node);
-void exfat_update_mtime(struct exfat_node* node);
+void exfat_update_atime(struct exfat* ef, struct exfat_node* node);
+void exfat_update_mtime(struct exfat* ef, struct exfat_node* node);
+int exfat_flush_times(struct exfat* ef, time_t age);
 const char* exfat_get_label(struct exfat* ef);
 int exfat_set_label(struct exfat* ef, const char* label);
 
 int exfat_mount(struct exfat* ef, const char* spec, const char* options);
 void exfat_unmount(struct exfat* ef);
+const char* exfat_get_option(const char* options, const char* option_name);
+int exfat_get_int_option(const char* options, const char* option_name,
+		int base, int default_value);
+bool exfat_match_option(const char* options, const char* option_name);
+bool exfat_match_value(const char* value, const char* name);
 
 time_t exfat_exfat2unix(le16_t date, le16_t time, uint8_t centisec);
 void exfat_unix2exfat(time_t unix_time, le16_t* date, le16_t* time,
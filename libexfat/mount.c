@@ -58,7 +58,7 @@ static uint64_t rootdir_size(const struct exfat* ef)
 	return (uint64_t) clusters * CLUSTER_SIZE(*ef->sb);
 }
 
-static const char* get_option(const char* options, const char* option_name)
+const char* exfat_get_option(const char* options, const char* option_name)
 {
 	const char* p;
 	size_t length = strlen(option_name);
@@ -69,17 +69,17 @@ static const char* get_option(const char* options, const char* option_name)
 	return NULL;
 }
 
-static int get_int_option(const char* options, const char* option_name,
+int exfat_get_int_option(const char* options, const char* option_name,
 		int base, int default_value)
 {
-	const char* p = get_option(options, option_name);
+	const char* p = exfat_get_option(options, option_name);
 
 	if (p == NULL)
 		return default_value;
 	return strtol(p, NULL, base);
 }
 
-static bool match_option(const char* options, const char* option_name)
+bool exfat_match_option(const char* options, const char* option_name)
 {
 	const char* p;
 	size_t length = strlen(option_name);
@@ -91,18 +91,45 @@ static bool match_option(const char* options, const char* option_name)
 	return false;
 }
 
+bool exfat_match_value(const char* value, const char* name)
+{
+	size_t length = strlen(name);
+
+	return strncmp(value, name, length) == 0 &&
+			(value[length] == ',' || value[length] == '\0');
+}
+
+static enum exfat_alloc_policy get_alloc_option(const char* options)
+{
+	const char* p = exfat_get_option(options, "alloc");
+
+	if (p == NULL || exfat_match_value(p, "first"))
+		return EXFAT_ALLOC_FIRST;
+	if (exfat_match_value(p, "next"))
+		return EXFAT_ALLOC_NEXT;
+	if (exfat_match_value(p, "best"))
+		return EXFAT_ALLOC_BEST;
+	if (exfat_match_value(p, "locality"))
+		return EXFAT_ALLOC_LOCALITY;
+	exfat_warn("unknown allocation policy, using first-fit");
+	return EXFAT_ALLOC_FIRST;
+}
+
 static void parse_options(struct exfat* ef, const char* options)
 {
 	int opt_umask;
 
-	opt_umask = get_int_option(options, "umask", 8, 0);
-	ef->dmask = get_int_option(options, "dmask", 8, opt_umask);
-	ef->fmask = get_int_option(options, "fmask", 8, opt_umask);
+	opt_umask = exfat_get_int_option(options, "umask", 8, 0);
+	ef->dmask = exfat_get_int_option(options, "dmask", 8, opt_umask);
+	ef->fmask = exfat_get_int_option(options, "fmask", 8, opt_umask);
 
-	ef->uid = get_int_option(options, "uid", 10, geteuid());
-	ef->gid = get_int_option(options, "gid", 10, getegid());
+	ef->uid = exfat_get_int_option(options, "uid", 10, geteuid());
+	ef->gid = exfat_get_int_option(options, "gid", 10, getegid());
 
-	ef->noatime = match_option(options, "noatime");
+	ef->noatime = exfat_match_option(options, "noatime");
+	ef->relatime = exfat_match_option(options, "relatime");
+	ef->lazytime = exfat_match_option(options, "lazytime");
+	ef->alloc_policy = get_alloc_option(options);
 }
 
 static bool verify_vbr_checksum(struct exfat_dev* dev, void* sector,
@@ -179,13 +206,13 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 
 	parse_options(ef, options);
 
-	if (match_option(options, "ro"))
+	if (exfat_match_option(options, "ro"))
 		mode = EXFAT_MODE_RO;
-	else if (match_option(options, "ro_fallback"))
+	else if (exfat_match_option(options, "ro_fallback"))
 		mode = EXFAT_MODE_ANY;
 	else
 		mode = EXFAT_MODE_RW;
-	ef->dev = exfat_open(spec, mode);
+	ef->dev = exfat_open(spec, mode, options);
 	if (ef->dev == NULL)
 		return -EIO;
 	if (exfat_get_mode(ef->dev) == EXFAT_MODE_RO)
@@ -195,6 +222,13 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 		else
 			ef->ro = 1;
 	}
+	if (exfat_match_option(options, "direct"))
+	{
+		rc = exfat_set_direct_io(ef->dev);
+		if (rc != 0)
+			exfat_warn("direct I/O is not available, using cached I/O: %s",
+					strerror(-rc));
+	}
 
 	ef->sb = malloc(sizeof(struct exfat_super_block));
 	if (ef->sb == NULL)
@@ -363,6 +397,7 @@ static void finalize_super_block(struct exfat* ef)
 
 void exfat_unmount(struct exfat* ef)
 {
+	exfat_reclaim(ef, UINT32_MAX);	/* ignore return code */
 	exfat_flush_nodes(ef);	/* ignore return code */
 	exfat_flush(ef);		/* ignore return code */
 	exfat_put_node(ef, ef->root);
@@ -376,6 +411,8 @@ void exfat_unmount(struct exfat* ef)
 	ef->zero_cluster = NULL;
 	free(ef->cmap.chunk);
 	ef->cmap.chunk = NULL;
+	free(ef->cmap.group_free);
+	ef->cmap.group_free = NULL;
 	free(ef->sb);
 	ef->sb = NULL;
 	free(ef->upcase);
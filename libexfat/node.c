@@ -25,13 +25,21 @@
 #include <string.h>
 #include <inttypes.h>
 
+/* file entry, file info entry and name entries of the longest name */
+#define ENTRY_SET_MAX (2 + DIV_ROUND_UP(EXFAT_NAME_MAX, EXFAT_ENAME_MAX))
+
+/* directories are preallocated by their used size, but not more than this */
+#define DIR_SLACK_MAX (256 * 1024)
+
 /* on-disk nodes iterator */
 struct iterator
 {
 	cluster_t cluster;
 	fbx_off_t offset;
 	int contiguous;
-	char* chunk;
+	const char* chunk;	/* current cluster, mapped or read into buffer */
+	char* buffer;		/* allocated when the cluster cannot be mapped */
+	bool mapped;
 };
 
 struct exfat_node* exfat_get_node(struct exfat_node* node)
@@ -54,6 +62,8 @@ void exfat_put_node(struct exfat* ef, struct exfat_node* node)
 	}
 	else if (node->references == 0 && node != ef->root)
 	{
+		/* nobody appends to the node anymore */
+		exfat_release_reservation(ef, node);
 		if (node->flags & EXFAT_ATTRIB_DIRTY)
 		{
 			exfat_get_name(node, buffer, sizeof(buffer) - 1);
@@ -62,26 +72,139 @@ void exfat_put_node(struct exfat* ef, struct exfat_node* node)
 	}
 }
 
+static void free_slots(struct exfat_node* dir)
+{
+	free(dir->slots);
+	dir->slots = NULL;
+	dir->slots_count = dir->slots_allocated = 0;
+}
+
+/* returns index of the first free run that starts after offset */
+static int find_run(const struct exfat_node* dir, fbx_off_t offset)
+{
+	int low = 0;
+	int high = dir->slots_count;
+
+	while (low < high)
+	{
+		const int middle = (low + high) / 2;
+
+		if (dir->slots[middle].offset <= offset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+/*
+ * Adds entries to the free runs of a cached directory, merging adjacent runs.
+ * If memory is exhausted the entries are just not reused until the directory
+ * is cached again.
+ */
+static void add_slot(struct exfat_node* dir, fbx_off_t offset, fbx_off_t size)
+{
+	const int i = find_run(dir, offset);
+	struct exfat_slot* prev = i > 0 ? &dir->slots[i - 1] : NULL;
+	struct exfat_slot* next = i < dir->slots_count ? &dir->slots[i] : NULL;
+
+	if (prev != NULL && prev->offset + prev->size == offset)
+	{
+		prev->size += size;
+		if (next != NULL && offset + size == next->offset)
+		{
+			prev->size += next->size;
+			memmove(next, next + 1,
+					(dir->slots_count - i - 1) * sizeof(struct exfat_slot));
+			dir->slots_count--;
+		}
+		return;
+	}
+	if (next != NULL && offset + size == next->offset)
+	{
+		next->offset = offset;
+		next->size += size;
+		return;
+	}
+
+	if (dir->slots_count == dir->slots_allocated)
+	{
+		const int allocated = MAX(dir->slots_allocated * 2, 8);
+		struct exfat_slot* slots = realloc(dir->slots,
+				allocated * sizeof(struct exfat_slot));
+
+		if (slots == NULL)
+			return;
+		dir->slots = slots;
+		dir->slots_allocated = allocated;
+	}
+	memmove(dir->slots + i + 1, dir->slots + i,
+			(dir->slots_count - i) * sizeof(struct exfat_slot));
+	dir->slots[i].offset = offset;
+	dir->slots[i].size = size;
+	dir->slots_count++;
+}
+
+/* removes entries found by find_slot() from the free runs */
+static void use_slot(struct exfat_node* dir, fbx_off_t offset, fbx_off_t size)
+{
+	const int i = find_run(dir, offset) - 1;
+	struct exfat_slot* run;
+
+	if (i < 0 || dir->slots[i].offset != offset || dir->slots[i].size < size)
+		exfat_bug("entries at %"PRId64" are not a free slot", offset);
+	run = &dir->slots[i];
+	run->offset += size;
+	run->size -= size;
+	if (run->size == 0)
+	{
+		memmove(run, run + 1,
+				(dir->slots_count - i - 1) * sizeof(struct exfat_slot));
+		dir->slots_count--;
+	}
+}
+
+/* drops free runs that are beyond the end of a shrunk directory */
+static void trim_slots(struct exfat_node* dir)
+{
+	struct exfat_slot* last;
+
+	while (dir->slots_count != 0 &&
+			dir->slots[dir->slots_count - 1].offset >= dir->size)
+		dir->slots_count--;
+	if (dir->slots_count == 0)
+		return;
+	last = &dir->slots[dir->slots_count - 1];
+	if (last->offset + last->size > dir->size)
+		last->size = dir->size - last->offset;
+}
+
 /**
  * This function must be called on rmdir and unlink (after the last
- * exfat_put_node()) to free clusters.
+ * exfat_put_node()) to free clusters. The clusters are not freed
+ * immediately but queued for exfat_reclaim(), so that removing a big file
+ * does not block the caller.
  */
 int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node)
 {
-	int rc = 0;
-
 	if (node->references != 0)
 		exfat_bug("unable to cleanup a node with %d references",
 				node->references);
 
 	if (node->flags & EXFAT_ATTRIB_UNLINKED)
 	{
-		/* free all clusters and node structure itself */
-		rc = exfat_truncate(ef, node, 0, true);
-		/* free the node even in case of error or its memory will be lost */
-		free(node);
+		free_slots(node);
+		if (node->size == 0)
+		{
+			free(node);
+			return 0;
+		}
+		node->parent = node->child = node->prev = NULL;
+		node->next = ef->reclaim;
+		ef->reclaim = node;
+		ef->reclaim_clusters += DIV_ROUND_UP(node->size, CLUSTER_SIZE(*ef->sb));
 	}
-	return rc;
+	return 0;
 }
 
 /**
@@ -92,36 +215,78 @@ static fbx_off_t co2o(struct exfat* ef, cluster_t cluster, fbx_off_t offset)
 	return exfat_c2o(ef, cluster) + offset % CLUSTER_SIZE(*ef->sb);
 }
 
-static int opendir(struct exfat* ef, const struct exfat_node* dir,
-		struct iterator* it)
+static void release_chunk(struct exfat* ef, struct iterator* it)
 {
-	if (!(dir->flags & EXFAT_ATTRIB_DIR))
-		exfat_bug("not a directory");
-	it->cluster = dir->start_cluster;
-	it->offset = 0;
-	it->contiguous = IS_CONTIGUOUS(*dir);
-	it->chunk = malloc(CLUSTER_SIZE(*ef->sb));
-	if (it->chunk == NULL)
+	if (it->mapped)
+		exfat_punmap(ef->dev, it->chunk, CLUSTER_SIZE(*ef->sb));
+	it->chunk = NULL;
+	it->mapped = false;
+}
+
+/*
+ * Makes the current cluster available through it->chunk. The cluster is
+ * accessed in place if the device allows that and read into the iterator's
+ * buffer otherwise.
+ */
+static int fetch_chunk(struct exfat* ef, struct iterator* it)
+{
+	release_chunk(ef, it);
+	it->chunk = exfat_pmap(ef->dev, CLUSTER_SIZE(*ef->sb),
+			exfat_c2o(ef, it->cluster));
+	if (it->chunk != NULL)
 	{
-		exfat_error("out of memory");
-		return -ENOMEM;
+		it->mapped = true;
+		return 0;
 	}
-	if (exfat_pread(ef->dev, it->chunk, CLUSTER_SIZE(*ef->sb),
-			exfat_c2o(ef, it->cluster)) < 0)
+
+	if (it->buffer == NULL)
 	{
-		exfat_error("failed to read directory cluster %#x", it->cluster);
-		return -EIO;
+		it->buffer = malloc(CLUSTER_SIZE(*ef->sb));
+		if (it->buffer == NULL)
+		{
+			exfat_error("out of memory");
+			return -ENOMEM;
+		}
 	}
+	if (exfat_pread_hint(ef->dev, it->buffer, CLUSTER_SIZE(*ef->sb),
+			exfat_c2o(ef, it->cluster), EXFAT_IO_METADATA) < 0)
+		return -EIO;
+	it->chunk = it->buffer;
 	return 0;
 }
 
-static void closedir(struct iterator* it)
+static void closedir(struct exfat* ef, struct iterator* it)
 {
+	release_chunk(ef, it);
 	it->cluster = 0;
 	it->offset = 0;
 	it->contiguous = 0;
-	free(it->chunk);
+	free(it->buffer);
+	it->buffer = NULL;
+}
+
+static int opendir(struct exfat* ef, const struct exfat_node* dir,
+		struct iterator* it)
+{
+	int rc;
+
+	if (!(dir->flags & EXFAT_ATTRIB_DIR))
+		exfat_bug("not a directory");
+	it->cluster = dir->start_cluster;
+	it->offset = 0;
+	it->contiguous = IS_CONTIGUOUS(*dir);
 	it->chunk = NULL;
+	it->buffer = NULL;
+	it->mapped = false;
+	rc = fetch_chunk(ef, it);
+	if (rc != 0)
+	{
+		if (rc == -EIO)
+			exfat_error("failed to read directory cluster %#x", it->cluster);
+		closedir(ef, it);
+		return rc;
+	}
+	return 0;
 }
 
 static bool fetch_next_entry(struct exfat* ef, const struct exfat_node* parent,
@@ -143,8 +308,7 @@ static bool fetch_next_entry(struct exfat* ef, const struct exfat_node* parent,
 					it->cluster);
 			return false;
 		}
-		if (exfat_pread(ef->dev, it->chunk, CLUSTER_SIZE(*ef->sb),
-				exfat_c2o(ef, it->cluster)) < 0)
+		if (fetch_chunk(ef, it) != 0)
 		{
 			exfat_error("failed to read the next directory cluster %#x",
 					it->cluster);
@@ -231,7 +395,7 @@ static bool check_node(const struct exfat_node* node, uint16_t actual_checksum,
  * Reads one entry in directory at position pointed by iterator and fills
  * node structure.
  */
-static int readdir(struct exfat* ef, const struct exfat_node* parent,
+static int readdir(struct exfat* ef, struct exfat_node* parent,
 		struct exfat_node** node, struct iterator* it)
 {
 	int rc = -EIO;
@@ -242,6 +406,7 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 	const struct exfat_entry_upcase* upcase;
 	const struct exfat_entry_bitmap* bitmap;
 	const struct exfat_entry_label* label;
+	le16_t label_name[EXFAT_ENAME_MAX];
 	uint8_t continuations = 0;
 	le16_t* namep = NULL;
 	uint16_t reference_checksum = 0;
@@ -298,6 +463,7 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 			/* new node has zero reference counter */
 			(*node)->entry_cluster = it->cluster;
 			(*node)->entry_offset = it->offset;
+			(*node)->meta[0] = *entry;
 			init_node_meta1(*node, meta1);
 			namep = (*node)->name;
 			break;
@@ -315,6 +481,7 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 				exfat_error("unknown flags in meta2 (0x%hhx)", meta2->flags);
 				goto error;
 			}
+			(*node)->meta[1] = *entry;
 			init_node_meta2(*node, meta2);
 			actual_checksum = exfat_add_checksum(entry, actual_checksum);
 			valid_size = le64_to_cpu(meta2->valid_size);
@@ -389,8 +556,11 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 			}
 			ef->upcase_chars = le64_to_cpu(upcase->size) / sizeof(le16_t);
 
-			if (exfat_pread(ef->dev, ef->upcase, le64_to_cpu(upcase->size),
-					exfat_c2o(ef, le32_to_cpu(upcase->start_cluster))) < 0)
+			/* read once and kept in memory, so not worth caching */
+			if (exfat_pread_hint(ef->dev, ef->upcase,
+					le64_to_cpu(upcase->size),
+					exfat_c2o(ef, le32_to_cpu(upcase->start_cluster)),
+					EXFAT_IO_DATA) < 0)
 			{
 				exfat_error("failed to read upper case table "
 						"(%"PRIu64" bytes starting at cluster %#x)",
@@ -430,9 +600,11 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 				goto error;
 			}
 
-			if (exfat_pread(ef->dev, ef->cmap.chunk,
+			/* same as the upcase table, only written back later */
+			if (exfat_pread_hint(ef->dev, ef->cmap.chunk,
 					BMAP_SIZE(ef->cmap.chunk_size),
-					exfat_c2o(ef, ef->cmap.start_cluster)) < 0)
+					exfat_c2o(ef, ef->cmap.start_cluster),
+					EXFAT_IO_DATA) < 0)
 			{
 				exfat_error("failed to read clusters bitmap "
 						"(%"PRIu64" bytes starting at cluster %#x)",
@@ -448,14 +620,21 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 				exfat_error("too long label (%hhu chars)", label->length);
 				goto error;
 			}
-			if (utf16_to_utf8(ef->label, label->name,
+			/* the entry is packed, so its name is copied out first */
+			memcpy(label_name, label->name, sizeof(label_name));
+			if (utf16_to_utf8(ef->label, label_name,
 						sizeof(ef->label) - 1, EXFAT_ENAME_MAX) != 0)
 				goto error;
 			break;
 
 		default:
 			if (!(entry->type & EXFAT_ENTRY_VALID))
-				break; /* deleted entry, ignore it */
+			{
+				/* deleted entry, remember it as a free slot */
+				if (continuations == 0)
+					add_slot(parent, it->offset, sizeof(struct exfat_entry));
+				break;
+			}
 			if (!(entry->type & EXFAT_ENTRY_OPTIONAL))
 			{
 				exfat_error("unknown entry type %#hhx", entry->type);
@@ -509,7 +688,7 @@ int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
 
 		current = node;
 	}
-	closedir(&it);
+	closedir(ef, &it);
 
 	if (rc != -ENOENT)
 	{
@@ -520,6 +699,7 @@ int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
 			free(current);
 		}
 		dir->child = NULL;
+		free_slots(dir);
 		return rc;
 	}
 
@@ -562,7 +742,8 @@ static void reset_cache(struct exfat* ef, struct exfat_node* node)
 		tree_detach(p);
 		free(p);
 	}
-	node->flags &= ~EXFAT_ATTRIB_CACHED;
+	free_slots(node);
+	node->flags &= ~(EXFAT_ATTRIB_CACHED | EXFAT_ATTRIB_SHRINK);
 	if (node->references != 0)
 	{
 		exfat_get_name(node, buffer, sizeof(buffer) - 1);
@@ -600,13 +781,91 @@ static bool next_entry(struct exfat* ef, const struct exfat_node* parent,
 	return true;
 }
 
+static int entry_set_length(const le16_t* name)
+{
+	return 2 + DIV_ROUND_UP(utf16_length(name), EXFAT_ENAME_MAX);
+}
+
+/*
+ * Describes n consecutive entries starting at the given position as a list of
+ * requests. A new request is started only where the entries continue in a
+ * cluster that does not follow the previous one on disk.
+ */
+static int map_entries(struct exfat* ef, const struct exfat_node* dir,
+		cluster_t cluster, fbx_off_t offset, const struct exfat_entry* entries,
+		int n, struct exfat_io* ios)
+{
+	int count = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		const fbx_off_t position = co2o(ef, cluster, offset);
+
+		if (count == 0 ||
+				ios[count - 1].offset + ios[count - 1].size != position)
+		{
+			ios[count].buffer = (void*) (entries + i);
+			ios[count].size = 0;
+			ios[count].offset = position;
+			count++;
+		}
+		ios[count - 1].size += sizeof(struct exfat_entry);
+		if (i + 1 < n && !next_entry(ef, dir, &cluster, &offset))
+			return -EIO;
+	}
+	return count;
+}
+
+static int write_entries(struct exfat* ef, const struct exfat_node* dir,
+		cluster_t cluster, fbx_off_t offset, const struct exfat_entry* entries,
+		int n)
+{
+	struct exfat_io ios[ENTRY_SET_MAX];
+	int count = map_entries(ef, dir, cluster, offset, entries, n, ios);
+
+	if (count < 0)
+		return count;
+	if (exfat_pwrite_batch(ef->dev, ios, count, EXFAT_IO_METADATA) != 0)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Fills name entries of the set and calculates its checksum. Meta1 and meta2
+ * must be already initialized.
+ */
+static void finish_entry_set(struct exfat_entry* entries, const le16_t* name)
+{
+	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &entries[0];
+	const int n = entry_set_length(name);
+	uint16_t checksum;
+	int i;
+
+	for (i = 2; i < n; i++)
+	{
+		struct exfat_entry_name* name_entry =
+				(struct exfat_entry_name*) &entries[i];
+		const int name_offset = (i - 2) * EXFAT_ENAME_MAX;
+
+		memset(name_entry, 0, sizeof(struct exfat_entry_name));
+		name_entry->type = EXFAT_ENTRY_FILE_NAME;
+		memcpy(name_entry->name, name + name_offset,
+				MIN(EXFAT_ENAME_MAX, EXFAT_NAME_MAX - name_offset) *
+				sizeof(le16_t));
+	}
+
+	checksum = exfat_start_checksum(meta1);
+	for (i = 1; i < n; i++)
+		checksum = exfat_add_checksum(&entries[i], checksum);
+	meta1->checksum = cpu_to_le16(checksum);
+}
+
 int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
 {
-	cluster_t cluster;
-	fbx_off_t offset;
-	fbx_off_t meta1_offset, meta2_offset;
-	struct exfat_entry_meta1 meta1;
-	struct exfat_entry_meta2 meta2;
+	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &node->meta[0];
+	struct exfat_entry_meta2* meta2 = (struct exfat_entry_meta2*) &node->meta[1];
+	le16_t edate, etime;
 
 	if (!(node->flags & EXFAT_ATTRIB_DIRTY))
 		return 0; /* no need to flush */
@@ -617,143 +876,123 @@ int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
 	if (node->parent == NULL)
 		return 0; /* do not flush unlinked node */
 
-	cluster = node->entry_cluster;
-	offset = node->entry_offset;
-	meta1_offset = co2o(ef, cluster, offset);
-	if (!next_entry(ef, node->parent, &cluster, &offset))
-		return -EIO;
-	meta2_offset = co2o(ef, cluster, offset);
-
-	if (exfat_pread(ef->dev, &meta1, sizeof(meta1), meta1_offset) < 0)
-	{
-		exfat_error("failed to read meta1 entry on flush");
-		return -EIO;
-	}
-	if (meta1.type != EXFAT_ENTRY_FILE)
-		exfat_bug("invalid type of meta1: 0x%hhx", meta1.type);
-	meta1.attrib = cpu_to_le16(node->flags);
-	exfat_unix2exfat(node->mtime, &meta1.mdate, &meta1.mtime, &meta1.mtime_cs);
-	exfat_unix2exfat(node->atime, &meta1.adate, &meta1.atime, NULL);
-
-	if (exfat_pread(ef->dev, &meta2, sizeof(meta2), meta2_offset) < 0)
-	{
-		exfat_error("failed to read meta2 entry on flush");
-		return -EIO;
-	}
-	if (meta2.type != EXFAT_ENTRY_FILE_INFO)
-		exfat_bug("invalid type of meta2: 0x%hhx", meta2.type);
-	meta2.size = meta2.valid_size = cpu_to_le64(node->size);
-	meta2.start_cluster = cpu_to_le32(node->start_cluster);
-	meta2.flags = EXFAT_FLAG_ALWAYS1;
+	/* meta entries are kept in the node, so there is nothing to read */
+	if (meta1->type != EXFAT_ENTRY_FILE)
+		exfat_bug("invalid type of meta1: 0x%hhx", meta1->type);
+	meta1->attrib = cpu_to_le16(node->flags);
+	/* entries are packed, so the fields are not passed by address */
+	exfat_unix2exfat(node->mtime, &edate, &etime, &meta1->mtime_cs);
+	meta1->mdate = edate;
+	meta1->mtime = etime;
+	exfat_unix2exfat(node->atime, &edate, &etime, NULL);
+	meta1->adate = edate;
+	meta1->atime = etime;
+
+	if (meta2->type != EXFAT_ENTRY_FILE_INFO)
+		exfat_bug("invalid type of meta2: 0x%hhx", meta2->type);
+	meta2->size = meta2->valid_size = cpu_to_le64(node->size);
+	meta2->start_cluster = cpu_to_le32(node->start_cluster);
+	meta2->flags = EXFAT_FLAG_ALWAYS1;
 	/* empty files must not be marked as contiguous */
 	if (node->size != 0 && IS_CONTIGUOUS(*node))
-		meta2.flags |= EXFAT_FLAG_CONTIGUOUS;
+		meta2->flags |= EXFAT_FLAG_CONTIGUOUS;
 	/* name hash remains unchanged, no need to recalculate it */
 
-	meta1.checksum = exfat_calc_checksum(&meta1, &meta2, node->name);
+	meta1->checksum = exfat_calc_checksum(meta1, meta2, node->name);
 
-	if (exfat_pwrite(ef->dev, &meta1, sizeof(meta1), meta1_offset) < 0)
-	{
-		exfat_error("failed to write meta1 entry on flush");
-		return -EIO;
-	}
-	if (exfat_pwrite(ef->dev, &meta2, sizeof(meta2), meta2_offset) < 0)
+	if (write_entries(ef, node->parent, node->entry_cluster,
+			node->entry_offset, node->meta, 2) != 0)
 	{
-		exfat_error("failed to write meta2 entry on flush");
+		exfat_error("failed to write meta entries on flush");
 		return -EIO;
 	}
 
-	node->flags &= ~EXFAT_ATTRIB_DIRTY;
+	node->flags &= ~(EXFAT_ATTRIB_DIRTY | EXFAT_ATTRIB_DIRTY_TIME);
 	return exfat_flush(ef);
 }
 
-static bool erase_entry(struct exfat* ef, struct exfat_node* node)
+/* marks the entry set built into entries as deleted */
+static bool erase_entries(struct exfat* ef, struct exfat_node* node,
+		struct exfat_entry* entries)
 {
-	cluster_t cluster = node->entry_cluster;
-	fbx_off_t offset = node->entry_offset;
-	int name_entries = DIV_ROUND_UP(utf16_length(node->name), EXFAT_ENAME_MAX);
-	uint8_t entry_type;
+	const int n = entry_set_length(node->name);
+	int i;
 
-	entry_type = EXFAT_ENTRY_FILE & ~EXFAT_ENTRY_VALID;
-	if (exfat_pwrite(ef->dev, &entry_type, 1, co2o(ef, cluster, offset)) < 0)
+	for (i = 0; i < n; i++)
+		entries[i].type &= ~EXFAT_ENTRY_VALID;
+	if (write_entries(ef, node->parent, node->entry_cluster,
+			node->entry_offset, entries, n) != 0)
 	{
-		exfat_error("failed to erase meta1 entry");
+		exfat_error("failed to erase entries");
 		return false;
 	}
+	add_slot(node->parent, node->entry_offset,
+			n * sizeof(struct exfat_entry));
+	return true;
+}
 
-	if (!next_entry(ef, node->parent, &cluster, &offset))
-		return false;
-	entry_type = EXFAT_ENTRY_FILE_INFO & ~EXFAT_ENTRY_VALID;
-	if (exfat_pwrite(ef->dev, &entry_type, 1, co2o(ef, cluster, offset)) < 0)
-	{
-		exfat_error("failed to erase meta2 entry");
-		return false;
-	}
+static bool erase_entry(struct exfat* ef, struct exfat_node* node)
+{
+	struct exfat_entry entries[ENTRY_SET_MAX];
 
-	while (name_entries--)
-	{
-		if (!next_entry(ef, node->parent, &cluster, &offset))
-			return false;
-		entry_type = EXFAT_ENTRY_FILE_NAME & ~EXFAT_ENTRY_VALID;
-		if (exfat_pwrite(ef->dev, &entry_type, 1,
-				co2o(ef, cluster, offset)) < 0)
-		{
-			exfat_error("failed to erase name entry");
-			return false;
-		}
-	}
-	return true;
+	memcpy(entries, node->meta, sizeof(node->meta));
+	finish_entry_set(entries, node->name);
+	return erase_entries(ef, node, entries);
 }
 
-static int shrink_directory(struct exfat* ef, struct exfat_node* dir,
-		fbx_off_t deleted_offset)
+/*
+ * Returns the size of a directory with the given number of bytes in use plus
+ * slack for new entries. The slack is proportional to the used size, so big
+ * directories are reallocated rarely.
+ */
+static uint64_t dir_size_with_slack(const struct exfat* ef, uint64_t used)
 {
-	const struct exfat_node* node;
-	const struct exfat_node* last_node;
-	uint64_t entries = 0;
+	const uint64_t size = ROUND_UP(used + MIN(used, DIR_SLACK_MAX),
+			CLUSTER_SIZE(*ef->sb));
+
+	/* directory always has at least 1 cluster */
+	return MAX(size, CLUSTER_SIZE(*ef->sb));
+}
+
+/*
+ * Truncates free entries at the end of a directory. Called by
+ * exfat_flush_nodes() for directories that had entries deleted.
+ */
+int exfat_shrink_directory(struct exfat* ef, struct exfat_node* dir)
+{
+	const struct exfat_slot* last;
+	uint64_t used = dir->size;
 	uint64_t new_size;
+	int rc;
 
 	if (!(dir->flags & EXFAT_ATTRIB_DIR))
 		exfat_bug("attempted to shrink a file");
 	if (!(dir->flags & EXFAT_ATTRIB_CACHED))
 		exfat_bug("attempted to shrink uncached directory");
 
-	for (last_node = node = dir->child; node; node = node->next)
-	{
-		if (deleted_offset < node->entry_offset)
-		{
-			/* there are other entries after the removed one, no way to shrink
-			   this directory */
-			return 0;
-		}
-		if (last_node->entry_offset < node->entry_offset)
-			last_node = node;
-	}
+	dir->flags &= ~EXFAT_ATTRIB_SHRINK;
 
-	if (last_node)
+	/* everything up to the trailing free run is in use */
+	if (dir->slots_count != 0)
 	{
-		/* offset of the last entry */
-		entries += last_node->entry_offset / sizeof(struct exfat_entry);
-		/* two subentries with meta info */
-		entries += 2;
-		/* subentries with file name */
-		entries += DIV_ROUND_UP(utf16_length(last_node->name),
-				EXFAT_ENAME_MAX);
+		last = &dir->slots[dir->slots_count - 1];
+		if (last->offset + last->size == dir->size)
+			used = last->offset;
 	}
 
-	new_size = DIV_ROUND_UP(entries * sizeof(struct exfat_entry),
-				 CLUSTER_SIZE(*ef->sb)) * CLUSTER_SIZE(*ef->sb);
-	if (new_size == 0) /* directory always has at least 1 cluster */
-		new_size = CLUSTER_SIZE(*ef->sb);
-	if (new_size == dir->size)
+	/* keep the slack grow_directory() would add and shrink only when most
+	   of the directory is unused, so that it does not oscillate */
+	new_size = dir_size_with_slack(ef, used);
+	if (dir->size < 2 * new_size)
 		return 0;
-	return exfat_truncate(ef, dir, new_size, true);
+	rc = exfat_truncate(ef, dir, new_size, true);
+	trim_slots(dir);
+	return rc;
 }
 
 static int delete(struct exfat* ef, struct exfat_node* node)
 {
 	struct exfat_node* parent = node->parent;
-	fbx_off_t deleted_offset = node->entry_offset;
 	int rc;
 
 	exfat_get_node(parent);
@@ -762,16 +1001,13 @@ static int delete(struct exfat* ef, struct exfat_node* node)
 		exfat_put_node(ef, parent);
 		return -EIO;
 	}
-	exfat_update_mtime(parent);
+	exfat_update_mtime(ef, parent);
+	exfat_release_reservation(ef, node);
 	tree_detach(node);
-	rc = shrink_directory(ef, parent, deleted_offset);
+	/* shrinking is deferred to exfat_flush_nodes(), so that a burst of
+	   deletes does not resize the directory each time */
+	parent->flags |= EXFAT_ATTRIB_SHRINK;
 	node->flags |= EXFAT_ATTRIB_UNLINKED;
-	if (rc != 0)
-	{
-		exfat_flush_node(ef, parent);
-		exfat_put_node(ef, parent);
-		return rc;
-	}
 	rc = exfat_flush_node(ef, parent);
 	exfat_put_node(ef, parent);
 	return rc;
@@ -799,56 +1035,142 @@ int exfat_rmdir(struct exfat* ef, struct exfat_node* node)
 	return delete(ef, node);
 }
 
+/* caches all directories of a tree and checks that its nodes are not used */
+static int prepare_tree(struct exfat* ef, struct exfat_node* dir)
+{
+	struct exfat_node* p;
+	int rc;
+
+	rc = exfat_cache_directory(ef, dir);
+	if (rc != 0)
+		return rc;
+	for (p = dir->child; p != NULL; p = p->next)
+	{
+		if (p->references != 0)
+			return -EBUSY;
+		if (p->flags & EXFAT_ATTRIB_DIR)
+		{
+			rc = prepare_tree(ef, p);
+			if (rc != 0)
+				return rc;
+		}
+	}
+	return 0;
+}
+
+/* queues clusters of all nodes below an unlinked directory for reclaim */
+static void release_tree(struct exfat* ef, struct exfat_node* dir)
+{
+	while (dir->child)
+	{
+		struct exfat_node* p = dir->child;
+
+		release_tree(ef, p);
+		tree_detach(p);
+		/* entries of the node are gone together with the directory, so
+		   there is nothing to flush */
+		p->flags &= ~EXFAT_ATTRIB_DIRTY;
+		p->flags |= EXFAT_ATTRIB_UNLINKED;
+		exfat_cleanup_node(ef, p);
+	}
+}
+
+/*
+ * Removes a directory with all its contents. Only the entry of the directory
+ * itself is erased, and clusters of the whole tree are queued for
+ * exfat_reclaim(), so the bitmap is updated in one pass. Like with
+ * exfat_rmdir(), exfat_cleanup_node() must be called for the node after the
+ * last exfat_put_node().
+ */
+int exfat_remove_tree(struct exfat* ef, struct exfat_node* node)
+{
+	int rc;
+
+	/* the root has no entry to erase */
+	if (node->parent == NULL)
+		return -EBUSY;
+	if (!(node->flags & EXFAT_ATTRIB_DIR))
+		return exfat_unlink(ef, node);
+	rc = prepare_tree(ef, node);
+	if (rc != 0)
+		return rc;
+	rc = delete(ef, node);
+	/* the tree is unreachable once the entry is erased */
+	if (node->flags & EXFAT_ATTRIB_UNLINKED)
+		release_tree(ef, node);
+	return rc;
+}
+
 static int grow_directory(struct exfat* ef, struct exfat_node* dir,
 		uint64_t asize, uint32_t difference)
 {
-	return exfat_truncate(ef, dir,
-			DIV_ROUND_UP(asize + difference, CLUSTER_SIZE(*ef->sb))
-				* CLUSTER_SIZE(*ef->sb), true);
+	const uint64_t needed = ROUND_UP(asize + difference, CLUSTER_SIZE(*ef->sb));
+	int rc;
+
+	rc = exfat_truncate(ef, dir, MAX(needed, dir_size_with_slack(ef, asize)),
+			true);
+	if (rc == -ENOSPC)
+		rc = exfat_truncate(ef, dir, needed, true);
+	if (rc != 0)
+		return rc;
+	/* new clusters are erased, so all their entries are free */
+	add_slot(dir, asize, dir->size - asize);
+	return 0;
 }
 
+/*
+ * Finds the first run of free entries that can hold the given number of
+ * subentries, growing the directory if there is no such run. The entries
+ * must be claimed with use_slot() once they are written.
+ */
 static int find_slot(struct exfat* ef, struct exfat_node* dir,
 		cluster_t* cluster, fbx_off_t* offset, int subentries)
 {
-	struct iterator it;
+	const fbx_off_t size = subentries * sizeof(struct exfat_entry);
+	const struct exfat_slot* run = NULL;
 	int rc;
-	const struct exfat_entry* entry;
-	int contiguous = 0;
+	int i;
 
-	rc = opendir(ef, dir, &it);
+	rc = exfat_cache_directory(ef, dir);
 	if (rc != 0)
 		return rc;
-	for (;;)
-	{
-		if (contiguous == 0)
-		{
-			*cluster = it.cluster;
-			*offset = it.offset;
-		}
-		entry = get_entry_ptr(ef, &it);
-		if (entry->type & EXFAT_ENTRY_VALID)
-			contiguous = 0;
-		else
-			contiguous++;
-		if (contiguous == subentries)
-			break;	/* suitable slot is found */
-		if (it.offset + sizeof(struct exfat_entry) >= dir->size)
+
+	for (i = 0; i < dir->slots_count; i++)
+		if (dir->slots[i].size >= size)
 		{
-			rc = grow_directory(ef, dir, dir->size,
-					(subentries - contiguous) * sizeof(struct exfat_entry));
-			if (rc != 0)
-			{
-				closedir(&it);
-				return rc;
-			}
+			run = &dir->slots[i];
+			break;
 		}
-		if (!fetch_next_entry(ef, dir, &it))
+	if (run == NULL)
+	{
+		fbx_off_t tail = 0;
+
+		/* free entries at the end of the directory become a part of the
+		   new slot */
+		if (dir->slots_count != 0)
 		{
-			closedir(&it);
-			return -EIO;
+			run = &dir->slots[dir->slots_count - 1];
+			if (run->offset + run->size == dir->size)
+				tail = run->size;
 		}
+		rc = grow_directory(ef, dir, dir->size, size - tail);
+		if (rc != 0)
+			return rc;
+		if (dir->slots_count == 0)
+			return -ENOMEM;
+		run = &dir->slots[dir->slots_count - 1];
+		if (run->size < size)
+			return -ENOMEM;
+	}
+
+	*offset = run->offset;
+	*cluster = exfat_advance_cluster(ef, dir,
+			*offset / CLUSTER_SIZE(*ef->sb));
+	if (CLUSTER_INVALID(*cluster))
+	{
+		exfat_error("invalid cluster %#x while looking for a slot", *cluster);
+		return -EIO;
 	}
-	closedir(&it);
 	return 0;
 }
 
@@ -856,11 +1178,12 @@ static int write_entry(struct exfat* ef, struct exfat_node* dir,
 		const le16_t* name, cluster_t cluster, fbx_off_t offset, uint16_t attrib)
 {
 	struct exfat_node* node;
-	struct exfat_entry_meta1 meta1;
-	struct exfat_entry_meta2 meta2;
+	struct exfat_entry entries[ENTRY_SET_MAX];
+	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &entries[0];
+	struct exfat_entry_meta2* meta2 = (struct exfat_entry_meta2*) &entries[1];
 	const size_t name_length = utf16_length(name);
 	const int name_entries = DIV_ROUND_UP(name_length, EXFAT_ENAME_MAX);
-	int i;
+	le16_t edate, etime;
 
 	node = allocate_node();
 	if (node == NULL)
@@ -869,60 +1192,39 @@ static int write_entry(struct exfat* ef, struct exfat_node* dir,
 	node->entry_offset = offset;
 	memcpy(node->name, name, name_length * sizeof(le16_t));
 
-	memset(&meta1, 0, sizeof(meta1));
-	meta1.type = EXFAT_ENTRY_FILE;
-	meta1.continuations = 1 + name_entries;
-	meta1.attrib = cpu_to_le16(attrib);
-	exfat_unix2exfat(time(NULL), &meta1.crdate, &meta1.crtime,
-			&meta1.crtime_cs);
-	meta1.adate = meta1.mdate = meta1.crdate;
-	meta1.atime = meta1.mtime = meta1.crtime;
-	meta1.mtime_cs = meta1.crtime_cs; /* there is no atime_cs */
-
-	memset(&meta2, 0, sizeof(meta2));
-	meta2.type = EXFAT_ENTRY_FILE_INFO;
-	meta2.flags = EXFAT_FLAG_ALWAYS1;
-	meta2.name_length = name_length;
-	meta2.name_hash = exfat_calc_name_hash(ef, node->name);
-	meta2.start_cluster = cpu_to_le32(EXFAT_CLUSTER_FREE);
-
-	meta1.checksum = exfat_calc_checksum(&meta1, &meta2, node->name);
-
-	if (exfat_pwrite(ef->dev, &meta1, sizeof(meta1),
-			co2o(ef, cluster, offset)) < 0)
-	{
-		exfat_error("failed to write meta1 entry");
-		return -EIO;
-	}
-	if (!next_entry(ef, dir, &cluster, &offset))
-		return -EIO;
-	if (exfat_pwrite(ef->dev, &meta2, sizeof(meta2),
-			co2o(ef, cluster, offset)) < 0)
+	memset(meta1, 0, sizeof(struct exfat_entry_meta1));
+	meta1->type = EXFAT_ENTRY_FILE;
+	meta1->continuations = 1 + name_entries;
+	meta1->attrib = cpu_to_le16(attrib);
+	exfat_unix2exfat(time(NULL), &edate, &etime, &meta1->crtime_cs);
+	meta1->adate = meta1->mdate = meta1->crdate = edate;
+	meta1->atime = meta1->mtime = meta1->crtime = etime;
+	meta1->mtime_cs = meta1->crtime_cs; /* there is no atime_cs */
+
+	memset(meta2, 0, sizeof(struct exfat_entry_meta2));
+	meta2->type = EXFAT_ENTRY_FILE_INFO;
+	meta2->flags = EXFAT_FLAG_ALWAYS1;
+	meta2->name_length = name_length;
+	meta2->name_hash = exfat_calc_name_hash(ef, node->name);
+	meta2->start_cluster = cpu_to_le32(EXFAT_CLUSTER_FREE);
+
+	finish_entry_set(entries, node->name);
+
+	if (write_entries(ef, dir, cluster, offset, entries,
+			2 + name_entries) != 0)
 	{
-		exfat_error("failed to write meta2 entry");
+		exfat_error("failed to write entries");
+		free(node);
 		return -EIO;
 	}
-	for (i = 0; i < name_entries; i++)
-	{
-		struct exfat_entry_name name_entry = {EXFAT_ENTRY_FILE_NAME, 0};
-		memcpy(name_entry.name, node->name + i * EXFAT_ENAME_MAX,
-				MIN(EXFAT_ENAME_MAX, EXFAT_NAME_MAX - i * EXFAT_ENAME_MAX) *
-				sizeof(le16_t));
-		if (!next_entry(ef, dir, &cluster, &offset))
-			return -EIO;
-		if (exfat_pwrite(ef->dev, &name_entry, sizeof(name_entry),
-				co2o(ef, cluster, offset)) < 0)
-		{
-			exfat_error("failed to write name entry");
-			return -EIO;
-		}
-	}
 
-	init_node_meta1(node, &meta1);
-	init_node_meta2(node, &meta2);
+	use_slot(dir, offset, (2 + name_entries) * sizeof(struct exfat_entry));
+	memcpy(node->meta, entries, sizeof(node->meta));
+	init_node_meta1(node, meta1);
+	init_node_meta2(node, meta2);
 
 	tree_attach(dir, node);
-	exfat_update_mtime(dir);
+	exfat_update_mtime(ef, dir);
 	return 0;
 }
 
@@ -1002,69 +1304,43 @@ static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 		struct exfat_node* node, const le16_t* name, cluster_t new_cluster,
 		fbx_off_t new_offset)
 {
-	struct exfat_entry_meta1 meta1;
-	struct exfat_entry_meta2 meta2;
-	cluster_t old_cluster = node->entry_cluster;
-	fbx_off_t old_offset = node->entry_offset;
+	struct exfat_entry old_entries[ENTRY_SET_MAX];
+	struct exfat_entry entries[ENTRY_SET_MAX];
+	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &entries[0];
+	struct exfat_entry_meta2* meta2 = (struct exfat_entry_meta2*) &entries[1];
 	const size_t name_length = utf16_length(name);
 	const int name_entries = DIV_ROUND_UP(name_length, EXFAT_ENAME_MAX);
-	int i;
 
-	if (exfat_pread(ef->dev, &meta1, sizeof(meta1),
-			co2o(ef, old_cluster, old_offset)) < 0)
-	{
-		exfat_error("failed to read meta1 entry on rename");
-		return -EIO;
-	}
-	if (!next_entry(ef, node->parent, &old_cluster, &old_offset))
-		return -EIO;
-	if (exfat_pread(ef->dev, &meta2, sizeof(meta2),
-			co2o(ef, old_cluster, old_offset)) < 0)
+	memcpy(old_entries, node->meta, sizeof(node->meta));
+	finish_entry_set(old_entries, node->name);
+	memcpy(entries, node->meta, sizeof(node->meta));
+	meta1->continuations = 1 + name_entries;
+	meta2->name_hash = exfat_calc_name_hash(ef, name);
+	meta2->name_length = name_length;
+	finish_entry_set(entries, name);
+
+	/* claim the new slot before the old one is added to the free runs,
+	   they might be merged otherwise */
+	use_slot(dir, new_offset, (2 + name_entries) * sizeof(struct exfat_entry));
+	if (!erase_entries(ef, node, old_entries))
 	{
-		exfat_error("failed to read meta2 entry on rename");
+		/* nothing was written to the new slot, so it is still free */
+		add_slot(dir, new_offset,
+				(2 + name_entries) * sizeof(struct exfat_entry));
 		return -EIO;
 	}
-	meta1.continuations = 1 + name_entries;
-	meta2.name_hash = exfat_calc_name_hash(ef, name);
-	meta2.name_length = name_length;
-	meta1.checksum = exfat_calc_checksum(&meta1, &meta2, name);
-
-	if (!erase_entry(ef, node))
-		return -EIO;
 
 	node->entry_cluster = new_cluster;
 	node->entry_offset = new_offset;
 
-	if (exfat_pwrite(ef->dev, &meta1, sizeof(meta1),
-			co2o(ef, new_cluster, new_offset)) < 0)
-	{
-		exfat_error("failed to write meta1 entry on rename");
-		return -EIO;
-	}
-	if (!next_entry(ef, dir, &new_cluster, &new_offset))
-		return -EIO;
-	if (exfat_pwrite(ef->dev, &meta2, sizeof(meta2),
-			co2o(ef, new_cluster, new_offset)) < 0)
+	if (write_entries(ef, dir, new_cluster, new_offset, entries,
+			2 + name_entries) != 0)
 	{
-		exfat_error("failed to write meta2 entry on rename");
+		exfat_error("failed to write entries on rename");
 		return -EIO;
 	}
 
-	for (i = 0; i < name_entries; i++)
-	{
-		struct exfat_entry_name name_entry = {EXFAT_ENTRY_FILE_NAME, 0};
-		memcpy(name_entry.name, name + i * EXFAT_ENAME_MAX,
-				EXFAT_ENAME_MAX * sizeof(le16_t));
-		if (!next_entry(ef, dir, &new_cluster, &new_offset))
-			return -EIO;
-		if (exfat_pwrite(ef->dev, &name_entry, sizeof(name_entry),
-				co2o(ef, new_cluster, new_offset)) < 0)
-		{
-			exfat_error("failed to write name entry on rename");
-			return -EIO;
-		}
-	}
-
+	memcpy(node->meta, entries, sizeof(node->meta));
 	memcpy(node->name, name, (EXFAT_NAME_MAX + 1) * sizeof(le16_t));
 	tree_detach(node);
 	tree_attach(dir, node);
@@ -1170,16 +1446,128 @@ void exfat_utimes(struct exfat_node* node, const struct timespec tv[2])
 	node->flags |= EXFAT_ATTRIB_DIRTY;
 }
 
-void exfat_update_atime(struct exfat_node* node)
+/* with lazytime timestamps are kept in memory until exfat_flush_times() */
+static void times_changed(struct exfat* ef, struct exfat_node* node)
 {
-	node->atime = time(NULL);
-	node->flags |= EXFAT_ATTRIB_DIRTY;
+	if (!ef->lazytime)
+	{
+		node->flags |= EXFAT_ATTRIB_DIRTY;
+		return;
+	}
+	if (!(node->flags & EXFAT_ATTRIB_DIRTY_TIME) && ef->lazy_since == 0)
+		ef->lazy_since = time(NULL);
+	node->flags |= EXFAT_ATTRIB_DIRTY_TIME;
 }
 
-void exfat_update_mtime(struct exfat_node* node)
+void exfat_update_atime(struct exfat* ef, struct exfat_node* node)
+{
+	const time_t now = time(NULL);
+
+	/* relatime: update only if the node was modified since the last access
+	   or the access time is older than one day */
+	if (ef->relatime && node->atime > node->mtime &&
+			now - node->atime < 24 * 60 * 60)
+		return;
+	node->atime = now;
+	times_changed(ef, node);
+}
+
+void exfat_update_mtime(struct exfat* ef, struct exfat_node* node)
 {
 	node->mtime = time(NULL);
-	node->flags |= EXFAT_ATTRIB_DIRTY;
+	times_changed(ef, node);
+}
+
+struct lazy_node
+{
+	fbx_off_t offset;
+	struct exfat_node* node;
+};
+
+static int compare_lazy_nodes(const void* a, const void* b)
+{
+	const fbx_off_t x = ((const struct lazy_node*) a)->offset;
+	const fbx_off_t y = ((const struct lazy_node*) b)->offset;
+
+	return x < y ? -1 : x > y;
+}
+
+static size_t collect_lazy_nodes(struct exfat* ef, struct exfat_node* dir,
+		struct lazy_node* nodes, size_t count)
+{
+	struct exfat_node* p;
+
+	for (p = dir->child; p != NULL; p = p->next)
+	{
+		if (p->flags & EXFAT_ATTRIB_DIRTY_TIME)
+		{
+			if (nodes != NULL)
+			{
+				nodes[count].offset = co2o(ef, p->entry_cluster,
+						p->entry_offset);
+				nodes[count].node = p;
+			}
+			count++;
+		}
+		count = collect_lazy_nodes(ef, p, nodes, count);
+	}
+	return count;
+}
+
+static int flush_lazy_nodes(struct exfat* ef, struct exfat_node* dir)
+{
+	struct exfat_node* p;
+	int rc;
+
+	for (p = dir->child; p != NULL; p = p->next)
+	{
+		if (p->flags & EXFAT_ATTRIB_DIRTY_TIME)
+		{
+			p->flags |= EXFAT_ATTRIB_DIRTY;
+			rc = exfat_flush_node(ef, p);
+			if (rc != 0)
+				return rc;
+		}
+		rc = flush_lazy_nodes(ef, p);
+		if (rc != 0)
+			return rc;
+	}
+	return 0;
+}
+
+/*
+ * Writes timestamps delayed by lazytime if the oldest of them is at least
+ * age seconds old. Nodes are written in the order of their entries on disk.
+ */
+int exfat_flush_times(struct exfat* ef, time_t age)
+{
+	struct lazy_node* nodes;
+	size_t count;
+	size_t i;
+	int rc = 0;
+
+	if (ef->lazy_since == 0 || time(NULL) - ef->lazy_since < age)
+		return 0;
+
+	count = collect_lazy_nodes(ef, ef->root, NULL, 0);
+	/* if there is no memory for sorting nodes are written in tree order */
+	nodes = malloc(count * sizeof(struct lazy_node));
+	if (nodes != NULL)
+	{
+		collect_lazy_nodes(ef, ef->root, nodes, 0);
+		qsort(nodes, count, sizeof(struct lazy_node), compare_lazy_nodes);
+		for (i = 0; i < count && rc == 0; i++)
+		{
+			nodes[i].node->flags |= EXFAT_ATTRIB_DIRTY;
+			rc = exfat_flush_node(ef, nodes[i].node);
+		}
+		free(nodes);
+	}
+	else
+		rc = flush_lazy_nodes(ef, ef->root);
+	if (rc == 0)
+		ef->lazy_since = 0;
+	return rc;
 }
 
 const char* exfat_get_label(struct exfat* ef)
@@ -1200,7 +1588,7 @@ static int find_label(struct exfat* ef, cluster_t* cluster, fbx_off_t* offset)
 	{
 		if (it.offset >= ef->root->size)
 		{
-			closedir(&it);
+			closedir(ef, &it);
 			return -ENOENT;
 		}
 
@@ -1208,13 +1596,13 @@ static int find_label(struct exfat* ef, cluster_t* cluster, fbx_off_t* offset)
 		{
 			*cluster = it.cluster;
 			*offset = it.offset;
-			closedir(&it);
+			closedir(ef, &it);
 			return 0;
 		}
 
 		if (!fetch_next_entry(ef, ef->root, &it))
 		{
-			closedir(&it);
+			closedir(ef, &it);
 			return -EIO;
 		}
 	}
@@ -1227,6 +1615,7 @@ int exfat_set_label(struct exfat* ef, const char* label)
 	cluster_t cluster;
 	fbx_off_t offset;
 	struct exfat_entry_label entry;
+	bool existing;
 
 	memset(label_utf16, 0, sizeof(label_utf16));
 	rc = utf8_to_utf16(label_utf16, label, EXFAT_ENAME_MAX, strlen(label));
@@ -1234,6 +1623,7 @@ int exfat_set_label(struct exfat* ef, const char* label)
 		return rc;
 
 	rc = find_label(ef, &cluster, &offset);
+	existing = (rc == 0);
 	if (rc == -ENOENT)
 		rc = find_slot(ef, ef->root, &cluster, &offset, 1);
 	if (rc != 0)
@@ -1245,12 +1635,16 @@ int exfat_set_label(struct exfat* ef, const char* label)
 	if (entry.length == 0)
 		entry.type ^= EXFAT_ENTRY_VALID;
 
-	if (exfat_pwrite(ef->dev, &entry, sizeof(struct exfat_entry_label),
-			co2o(ef, cluster, offset)) < 0)
+	if (exfat_pwrite_hint(ef->dev, &entry, sizeof(struct exfat_entry_label),
+			co2o(ef, cluster, offset), EXFAT_IO_METADATA) < 0)
 	{
 		exfat_error("failed to write label entry");
 		return -EIO;
 	}
+	if (existing && entry.length == 0)
+		add_slot(ef->root, offset, sizeof(struct exfat_entry));
+	else if (!existing && entry.length != 0)
+		use_slot(ef->root, offset, sizeof(struct exfat_entry));
 	strcpy(ef->label, label);
 	return 0;
 }
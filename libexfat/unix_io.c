@@ -20,6 +20,9 @@
 	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for O_DIRECT */
+#endif
 #include "exfat.h"
 #include <inttypes.h>
 #include <sys/types.h>
@@ -37,10 +40,45 @@
 #include <sys/ioctl.h>
 #endif
 #include <sys/mount.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#endif
 #ifdef USE_UBLIO
 #include <sys/uio.h>
 #include <ublio.h>
 #endif
+#ifdef USE_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef USE_IO_URING
+#include <liburing.h>
+#endif
+
+#if defined(USE_MMAP) && defined(USE_UBLIO)
+#error USE_MMAP and USE_UBLIO cannot be used together
+#endif
+#if defined(USE_IO_URING) && defined(USE_UBLIO)
+#error USE_IO_URING and USE_UBLIO cannot be used together
+#endif
+
+#ifdef USE_MMAP
+/* Images larger than this are accessed with pread/pwrite even on 64-bit
+   hosts to avoid exhausting the address space. */
+#define MMAP_MAX_SIZE ((fbx_off_t) 1 << 40)
+#endif
+
+#ifdef USE_IO_URING
+#define URING_ENTRIES 32
+/* completion result is a signed 32-bit value, so split bigger requests */
+#define URING_MAX_IO (1u << 30)
+#endif
+
+#if defined(O_DIRECT) && !defined(USE_UBLIO)
+#define HAVE_DIRECT_IO
+/* used for regular files, safe for any underlying file system */
+#define DIRECT_IO_ALIGN 4096
+#endif
 
 struct exfat_dev
 {
@@ -51,6 +89,20 @@ struct exfat_dev
 	fbx_off_t pos;
 	ublio_filehandle_t ufh;
 #endif
+#ifdef USE_MMAP
+	char* map; /* NULL if the device is not memory-mapped */
+#endif
+#ifdef USE_IO_URING
+	struct io_uring ring;
+	bool uring; /* false if io_uring is unavailable */
+	bool uring_broken; /* a submission failed, the ring must not be used */
+#endif
+#ifdef HAVE_DIRECT_IO
+	bool direct; /* O_DIRECT is set, requests must be aligned */
+	size_t align;
+	char* bounce; /* aligned buffer for unaligned requests */
+	size_t bounce_size;
+#endif
 };
 
 static int open_ro(const char* spec)
@@ -78,7 +130,8 @@ static int open_rw(const char* spec)
 	return fd;
 }
 
-struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
+struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode,
+		const char* options)
 {
 	struct exfat_dev* dev;
 	struct stat stbuf;
@@ -134,6 +187,8 @@ struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
 		free(dev);
 		exfat_error("failed to open '%s': %s", spec, strerror(errno));
 		return NULL;
+	default:
+		exfat_bug("invalid mode %d", mode);
 	}
 
 	if (fstat(dev->fd, &stbuf) != 0)
@@ -240,6 +295,49 @@ struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
 	}
 #endif
 
+#ifdef USE_MMAP
+	dev->map = NULL;
+	/* only regular files are mapped: block devices may change their size
+	   and 32-bit hosts do not have enough address space for big images */
+	if (S_ISREG(stbuf.st_mode) && sizeof(void*) >= 8 &&
+			dev->size <= MMAP_MAX_SIZE)
+	{
+		void* map = mmap(NULL, dev->size,
+				dev->mode == EXFAT_MODE_RW ? PROT_READ | PROT_WRITE : PROT_READ,
+				MAP_SHARED, dev->fd, 0);
+		if (map != MAP_FAILED)
+			dev->map = map;
+		else
+			exfat_warn("failed to map '%s', falling back to pread: %s", spec,
+					strerror(errno));
+	}
+#endif
+
+#ifdef USE_IO_URING
+	dev->uring = false;
+	dev->uring_broken = false;
+	/* a mapped image is accessed with memcpy(), so a ring would be idle */
+#ifdef USE_MMAP
+	if (dev->map == NULL && !exfat_match_option(options, "nouring"))
+#else
+	if (!exfat_match_option(options, "nouring"))
+#endif
+	{
+		int rc = io_uring_queue_init(URING_ENTRIES, &dev->ring, 0);
+		if (rc == 0)
+			dev->uring = true;
+		else
+			exfat_warn("io_uring is unavailable, using synchronous I/O: %s",
+					strerror(-rc));
+	}
+#endif
+
+#ifdef HAVE_DIRECT_IO
+	dev->direct = false;
+	dev->bounce = NULL;
+	dev->bounce_size = 0;
+#endif
+
 	return dev;
 }
 
@@ -247,6 +345,17 @@ int exfat_close(struct exfat_dev* dev)
 {
 	int rc = 0;
 
+#ifdef USE_IO_URING
+	if (dev->uring)
+		io_uring_queue_exit(&dev->ring);
+#endif
+#ifdef USE_MMAP
+	if (dev->map != NULL && munmap(dev->map, dev->size) != 0)
+	{
+		exfat_error("failed to unmap device: %s", strerror(errno));
+		rc = -EIO;
+	}
+#endif
 #ifdef USE_UBLIO
 	if (ublio_close(dev->ufh) != 0)
 	{
@@ -259,6 +368,9 @@ int exfat_close(struct exfat_dev* dev)
 		exfat_error("failed to close device: %s", strerror(errno));
 		rc = -EIO;
 	}
+#ifdef HAVE_DIRECT_IO
+	free(dev->bounce);
+#endif
 	free(dev);
 	return rc;
 }
@@ -267,6 +379,13 @@ int exfat_fsync(struct exfat_dev* dev)
 {
 	int rc = 0;
 
+#ifdef USE_MMAP
+	if (dev->map != NULL && msync(dev->map, dev->size, MS_SYNC) != 0)
+	{
+		exfat_error("msync failed: %s", strerror(errno));
+		rc = -EIO;
+	}
+#endif
 #ifdef USE_UBLIO
 	if (ublio_fsync(dev->ufh) != 0)
 	{
@@ -326,9 +445,172 @@ ssize_t exfat_write(struct exfat_dev* dev, const void* buffer, size_t size)
 #endif
 }
 
+#ifdef USE_MMAP
+static bool is_mapped(const struct exfat_dev* dev, size_t size,
+		fbx_off_t offset)
+{
+	return dev->map != NULL && offset >= 0 && offset <= dev->size &&
+		size <= dev->size - offset;
+}
+#endif
+
+int exfat_writeback(struct exfat_dev* dev)
+{
+	/* the kernel writes back dirty pages by itself */
+	return 0;
+}
+
+int exfat_scrub(struct exfat_dev* dev, time_t interval)
+{
+	/* there is no cache of our own to check */
+	return 0;
+}
+
+/*
+ * Switches the device to O_DIRECT, so that data is not kept in the host page
+ * cache in addition to the caches above libexfat. Requests that are not
+ * aligned to the device block size are bounced through an aligned buffer.
+ */
+int exfat_set_direct_io(struct exfat_dev* dev)
+{
+#ifdef HAVE_DIRECT_IO
+	struct stat stbuf;
+	int flags;
+
+	if (fstat(dev->fd, &stbuf) != 0)
+	{
+		exfat_error("failed to fstat device: %s", strerror(errno));
+		return -EIO;
+	}
+	dev->align = DIRECT_IO_ALIGN;
+#ifdef __linux__
+	if (S_ISBLK(stbuf.st_mode))
+	{
+		int sector_size;
+
+		if (ioctl(dev->fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0)
+			dev->align = sector_size;
+	}
+#endif
+	/* the last block could not be written without extending the file */
+	if (dev->size % dev->align != 0)
+	{
+		exfat_debug("device size is not a multiple of %zu bytes",
+				dev->align);
+		return -EINVAL;
+	}
+#ifdef USE_MMAP
+	if (dev->map != NULL)
+	{
+		if (munmap(dev->map, dev->size) != 0)
+		{
+			exfat_error("failed to unmap device: %s", strerror(errno));
+			return -EIO;
+		}
+		dev->map = NULL;
+	}
+#endif
+	flags = fcntl(dev->fd, F_GETFL);
+	if (flags == -1 || fcntl(dev->fd, F_SETFL, flags | O_DIRECT) != 0)
+		return -errno;
+	dev->direct = true;
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+#ifdef HAVE_DIRECT_IO
+static bool is_aligned(const struct exfat_dev* dev, const void* buffer,
+		size_t size, fbx_off_t offset)
+{
+	return (((uint64_t) (uintptr_t) buffer | size | offset) &
+			(dev->align - 1)) == 0;
+}
+
+static char* get_bounce(struct exfat_dev* dev, size_t size)
+{
+	void* buffer;
+
+	if (size <= dev->bounce_size)
+		return dev->bounce;
+	if (posix_memalign(&buffer, dev->align, size) != 0)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	free(dev->bounce);
+	dev->bounce = buffer;
+	dev->bounce_size = size;
+	return buffer;
+}
+
+/* returns the number of caller's bytes covered by a bounced transfer */
+static ssize_t bounced(ssize_t rc, size_t head, size_t size)
+{
+	if (rc < 0)
+		return -1;
+	if ((size_t) rc <= head)
+		return 0;
+	return MIN((size_t) rc - head, size);
+}
+
+static ssize_t direct_pread(struct exfat_dev* dev, void* buffer, size_t size,
+		fbx_off_t offset)
+{
+	const size_t mask = dev->align - 1;
+	const size_t head = offset & mask;
+	const size_t length = (head + size + mask) & ~mask;
+	char* bounce = get_bounce(dev, length);
+	ssize_t rc;
+
+	if (bounce == NULL)
+		return -1;
+	rc = bounced(pread(dev->fd, bounce, length, offset - head), head, size);
+	if (rc > 0)
+		memcpy(buffer, bounce + head, rc);
+	return rc;
+}
+
+static ssize_t direct_pwrite(struct exfat_dev* dev, const void* buffer,
+		size_t size, fbx_off_t offset)
+{
+	const size_t mask = dev->align - 1;
+	const size_t head = offset & mask;
+	const size_t length = (head + size + mask) & ~mask;
+	const fbx_off_t start = offset - head;
+	const size_t last = length - dev->align;
+	char* bounce = get_bounce(dev, length);
+
+	if (bounce == NULL)
+		return -1;
+	/* read partially overwritten blocks at both ends */
+	if (head != 0 &&
+			pread(dev->fd, bounce, dev->align, start) != (ssize_t) dev->align)
+		return -1;
+	if (((head + size) & mask) != 0 && (head == 0 || last != 0) &&
+			pread(dev->fd, bounce + last, dev->align, start + last) !=
+				(ssize_t) dev->align)
+		return -1;
+	memcpy(bounce + head, buffer, size);
+	return bounced(pwrite(dev->fd, bounce, length, start), head, size);
+}
+#endif
+
 ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 		fbx_off_t offset)
 {
+#ifdef USE_MMAP
+	if (is_mapped(dev, size, offset))
+	{
+		memcpy(buffer, dev->map + offset, size);
+		return size;
+	}
+#endif
+#ifdef HAVE_DIRECT_IO
+	if (dev->direct && !is_aligned(dev, buffer, size, offset))
+		return direct_pread(dev, buffer, size, offset);
+#endif
 #ifdef USE_UBLIO
 	return ublio_pread(dev->ufh, buffer, size, offset);
 #else
@@ -339,6 +621,22 @@ ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 		fbx_off_t offset)
 {
+#ifdef USE_MMAP
+	if (is_mapped(dev, size, offset))
+	{
+		if (dev->mode != EXFAT_MODE_RW)
+		{
+			errno = EBADF;
+			return -1;
+		}
+		memcpy(dev->map + offset, buffer, size);
+		return size;
+	}
+#endif
+#ifdef HAVE_DIRECT_IO
+	if (dev->direct && !is_aligned(dev, buffer, size, offset))
+		return direct_pwrite(dev, buffer, size, offset);
+#endif
 #ifdef USE_UBLIO
 	return ublio_pwrite(dev->ufh, buffer, size, offset);
 #else
@@ -346,95 +644,174 @@ ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 #endif
 }
 
-ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
-		void* buffer, size_t size, fbx_off_t offset)
+/* the kernel page cache takes no hints per request */
+ssize_t exfat_pread_hint(struct exfat_dev* dev, void* buffer, size_t size,
+		fbx_off_t offset, enum exfat_io_hint hint)
 {
-	cluster_t cluster;
-	char* bufp = buffer;
-	fbx_off_t lsize, loffset, remainder;
+	return exfat_pread(dev, buffer, size, offset);
+}
 
-	if (offset >= node->size)
-		return 0;
-	if (size == 0)
-		return 0;
+ssize_t exfat_pwrite_hint(struct exfat_dev* dev, const void* buffer,
+		size_t size, fbx_off_t offset, enum exfat_io_hint hint)
+{
+	return exfat_pwrite(dev, buffer, size, offset);
+}
 
-	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
-	if (CLUSTER_INVALID(cluster))
-	{
-		exfat_error("invalid cluster 0x%x while reading", cluster);
-		return -1;
-	}
+static int sync_batch(struct exfat_dev* dev, const struct exfat_io* ios,
+		int count, bool write)
+{
+	int i;
 
-	loffset = offset % CLUSTER_SIZE(*ef->sb);
-	remainder = MIN(size, node->size - offset);
-	while (remainder > 0)
+	for (i = 0; i < count; i++)
 	{
-		if (CLUSTER_INVALID(cluster))
-		{
-			exfat_error("invalid cluster 0x%x while reading", cluster);
-			return -1;
-		}
-		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
-		if (exfat_pread(ef->dev, bufp, lsize,
-					exfat_c2o(ef, cluster) + loffset) < 0)
-		{
-			exfat_error("failed to read cluster %#x", cluster);
+		ssize_t rc = write ?
+			exfat_pwrite(dev, ios[i].buffer, ios[i].size, ios[i].offset) :
+			exfat_pread(dev, ios[i].buffer, ios[i].size, ios[i].offset);
+		if (rc < 0)
 			return -1;
-		}
-		bufp += lsize;
-		loffset = 0;
-		remainder -= lsize;
-		cluster = exfat_next_cluster(ef, node, cluster);
 	}
-	if (!ef->ro && !ef->noatime)
-		exfat_update_atime(node);
-	return MIN(size, node->size - offset) - remainder;
+	return 0;
 }
 
-ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
-		const void* buffer, size_t size, fbx_off_t offset)
+#ifdef USE_IO_URING
+static int complete_io(struct exfat_dev* dev, const struct exfat_io* io,
+		int res, bool write)
 {
-	cluster_t cluster;
-	const char* bufp = buffer;
-	fbx_off_t lsize, loffset, remainder;
+	struct exfat_io rest;
 
- 	if (offset > node->size)
- 		if (exfat_truncate(ef, node, offset, true) != 0)
- 			return -1;
-  	if (offset + size > node->size)
- 		if (exfat_truncate(ef, node, offset + size, false) != 0)
- 			return -1;
-	if (size == 0)
-		return 0;
-
-	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
-	if (CLUSTER_INVALID(cluster))
+	if (res < 0)
 	{
-		exfat_error("invalid cluster 0x%x while writing", cluster);
+		errno = -res;
 		return -1;
 	}
+	if ((size_t) res == io->size)
+		return 0;
+	/* short transfer, finish it synchronously */
+	rest.buffer = (char*) io->buffer + res;
+	rest.size = io->size - res;
+	rest.offset = io->offset + res;
+	return sync_batch(dev, &rest, 1, write);
+}
 
-	loffset = offset % CLUSTER_SIZE(*ef->sb);
-	remainder = size;
-	while (remainder > 0)
+static int uring_batch(struct exfat_dev* dev, const struct exfat_io* ios,
+		int count, bool write)
+{
+	struct io_uring_sqe* sqe;
+	struct io_uring_cqe* cqe;
+	int next = 0;
+	int queued = 0;
+	int inflight = 0;
+	int rc = 0;
+
+	for (;;)
 	{
-		if (CLUSTER_INVALID(cluster))
+		while (rc == 0 && next < count &&
+				(sqe = io_uring_get_sqe(&dev->ring)) != NULL)
 		{
-			exfat_error("invalid cluster 0x%x while writing", cluster);
-			return -1;
+			const struct exfat_io* io = &ios[next++];
+
+			if (write)
+				io_uring_prep_write(sqe, dev->fd, io->buffer,
+						MIN(io->size, URING_MAX_IO), io->offset);
+			else
+				io_uring_prep_read(sqe, dev->fd, io->buffer,
+						MIN(io->size, URING_MAX_IO), io->offset);
+			io_uring_sqe_set_data(sqe, (void*) io);
+			queued++;
 		}
-		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
-		if (exfat_pwrite(ef->dev, bufp, lsize,
-				exfat_c2o(ef, cluster) + loffset) < 0)
+		if (queued != 0 && !dev->uring_broken)
 		{
-			exfat_error("failed to write cluster %#x", cluster);
-			return -1;
+			int submitted = io_uring_submit(&dev->ring);
+			if (submitted < 0)
+			{
+				/* queued requests cannot be cancelled, so never submit
+				   anything to this ring again */
+				exfat_error("io_uring submission failed: %s",
+						strerror(-submitted));
+				dev->uring_broken = true;
+				errno = -submitted;
+				rc = -1;
+			}
+			else
+			{
+				queued -= submitted;
+				inflight += submitted;
+			}
+		}
+		if (inflight == 0)
+			break;
+
+		if (io_uring_wait_cqe(&dev->ring, &cqe) != 0)
+			exfat_bug("failed to wait for %d in-flight requests", inflight);
+		do
+		{
+			if (complete_io(dev, io_uring_cqe_get_data(cqe), cqe->res,
+					write) != 0)
+				rc = -1;
+			io_uring_cqe_seen(&dev->ring, cqe);
+			inflight--;
 		}
-		bufp += lsize;
-		loffset = 0;
-		remainder -= lsize;
-		cluster = exfat_next_cluster(ef, node, cluster);
+		while (inflight != 0 && io_uring_peek_cqe(&dev->ring, &cqe) == 0);
 	}
-	exfat_update_mtime(node);
-	return size - remainder;
+	return rc;
+}
+
+static bool can_submit(const struct exfat_dev* dev, const struct exfat_io* ios,
+		int count)
+{
+#ifdef HAVE_DIRECT_IO
+	int i;
+
+	/* unaligned requests have to be bounced by exfat_pread/pwrite() */
+	if (dev->direct)
+		for (i = 0; i < count; i++)
+			if (!is_aligned(dev, ios[i].buffer, ios[i].size, ios[i].offset))
+				return false;
+#endif
+	return dev->uring && !dev->uring_broken;
+}
+#endif
+
+/*
+ * Submits a batch of independent requests. Depending on the backend they
+ * are either kept in flight together or issued one by one. Returns 0 if all
+ * of them succeeded.
+ */
+int exfat_pread_batch(struct exfat_dev* dev, const struct exfat_io* ios,
+		int count, enum exfat_io_hint hint)
+{
+#ifdef USE_IO_URING
+	if (can_submit(dev, ios, count))
+		return uring_batch(dev, ios, count, false);
+#endif
+	return sync_batch(dev, ios, count, false);
+}
+
+int exfat_pwrite_batch(struct exfat_dev* dev, const struct exfat_io* ios,
+		int count, enum exfat_io_hint hint)
+{
+#ifdef USE_IO_URING
+	if (can_submit(dev, ios, count))
+		return uring_batch(dev, ios, count, true);
+#endif
+	return sync_batch(dev, ios, count, true);
+}
+
+/*
+ * Returns a pointer to device data if it can be accessed in place or NULL
+ * otherwise, in which case the caller should fall back to exfat_pread().
+ * The pointer must be released with exfat_punmap().
+ */
+const void* exfat_pmap(struct exfat_dev* dev, size_t size, fbx_off_t offset)
+{
+#ifdef USE_MMAP
+	if (is_mapped(dev, size, offset))
+		return dev->map + offset;
+#endif
+	return NULL;
+}
+
+void exfat_punmap(struct exfat_dev* dev, const void* ptr, size_t size)
+{
+	/* nothing to release, the mapping lives until exfat_close() */
 }
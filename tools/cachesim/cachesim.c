@@ -0,0 +1,193 @@
+/**
+ * Copyright (c) 2015-2026 Fredrik Wikstrom <fredrik@a500.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Replays a trace of exFAT device accesses through the libdiskio block
+ * cache and counts the sectors that had to be read from the device,
+ * separately for metadata and for file data. Traces are recorded with
+ * tracerec, one access per line:
+ *
+ *   S <volume size> <sector size>   first line
+ *   R <offset> <length>             read
+ *   W <offset> <length>             write
+ *   D <offset> <length>             extent that holds file data
+ */
+
+#include "diskio_internal.h"
+#include "mockdev.h"
+#include <stdio.h>
+#include <unistd.h>
+
+static UBYTE *data_map;
+static ULONG sector_shift;
+static ULONG device_reads[2], device_writes;
+static ULONG requested[2];
+
+static int IsData(UQUAD sector) {
+	return (data_map[sector >> 3] >> (sector & 7)) & 1;
+}
+
+static void CountIO(BOOL write, UQUAD offset, ULONG length) {
+	UQUAD sector, end;
+
+	if (write) {
+		device_writes++;
+		return;
+	}
+
+	end = (offset + length - 1) >> sector_shift;
+	for (sector = offset >> sector_shift; sector <= end; sector++)
+		device_reads[IsData(sector)]++;
+}
+
+static int MatchValue(const char *arg, const char *const *names, ULONG *value) {
+	ULONG i;
+
+	for (i = 0; names[i] != NULL; i++) {
+		if (strcmp(arg, names[i]) == 0) {
+			*value = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void Usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-p slru|arc] [-v never|always|sampled|scrub] [-n period]\n"
+		"       [-s page size] [-m memory MB] [-H] <trace>\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	static const char *const policies[] = { "slru", "arc", NULL };
+	static const char *const verify_modes[] = { "never", "always", "sampled", "scrub", NULL };
+	ULONG policy = DIOCP_SLRU, verify = DIOCV_ALWAYS, period = 16;
+	ULONG page_size = 4096, memory = 64;
+	int hints = 0;
+	struct TagItem tags[6];
+	struct DiskIO *dio;
+	FILE *trace;
+	char line[128], op;
+	unsigned long long offset, length, size = 0, sector_size = 0;
+	UQUAD sector, end;
+	APTR buffer;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:v:n:s:m:H")) != -1) {
+		switch (c) {
+			case 'p':
+				if (!MatchValue(optarg, policies, &policy))
+					Usage(argv[0]);
+				break;
+			case 'v':
+				if (!MatchValue(optarg, verify_modes, &verify))
+					Usage(argv[0]);
+				break;
+			case 'n':
+				period = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				page_size = strtoul(optarg, NULL, 10);
+				break;
+			case 'm':
+				memory = strtoul(optarg, NULL, 10);
+				break;
+			case 'H':
+				hints = 1;
+				break;
+			default:
+				Usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		Usage(argv[0]);
+
+	trace = fopen(argv[optind], "r");
+	if (trace == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	/* First pass, find the volume size and which sectors hold file data */
+	while (fgets(line, sizeof(line), trace) != NULL) {
+		if (sscanf(line, "S %llu %llu", &size, &sector_size) == 2) {
+			sector_shift = __builtin_ctzll(sector_size);
+			data_map = calloc(1, ((size >> sector_shift) + 7) >> 3);
+			if (data_map == NULL) {
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+		} else if (sscanf(line, "D %llu %llu", &offset, &length) == 2 && data_map != NULL) {
+			end = (offset + length - 1) >> sector_shift;
+			for (sector = offset >> sector_shift; sector <= end; sector++)
+				data_map[sector >> 3] |= 1 << (sector & 7);
+		}
+	}
+	if (data_map == NULL) {
+		fprintf(stderr, "%s: no volume size in trace\n", argv[optind]);
+		return 1;
+	}
+
+	tags[0].ti_Tag = DIOS_CachePolicy;   tags[0].ti_Data = policy;
+	tags[1].ti_Tag = DIOS_CacheVerify;   tags[1].ti_Data = verify;
+	tags[2].ti_Tag = DIOS_VerifyPeriod;  tags[2].ti_Data = period;
+	tags[3].ti_Tag = DIOS_CachePageSize; tags[3].ti_Data = page_size;
+	tags[4].ti_Tag = TAG_END;
+
+	dio = MockSetup(size, sector_size, memory << 20, tags);
+	buffer = malloc(1 << 20);
+	if (dio == NULL || buffer == NULL) {
+		fprintf(stderr, "failed to set up the cache\n");
+		return 1;
+	}
+	MockSetIOHook(CountIO);
+
+	/* Second pass, replay the accesses */
+	rewind(trace);
+	while (fgets(line, sizeof(line), trace) != NULL) {
+		ULONG hint = DIOCH_DEFAULT;
+
+		if (sscanf(line, "%c %llu %llu", &op, &offset, &length) != 3 || (op != 'R' && op != 'W'))
+			continue;
+		if (length > (1 << 20)) {
+			fprintf(stderr, "access of %llu bytes is too large\n", length);
+			return 1;
+		}
+
+		end = (offset + length - 1) >> sector_shift;
+		for (sector = offset >> sector_shift; sector <= end; sector++)
+			requested[IsData(sector)]++;
+
+		if (hints)
+			hint = IsData(offset >> sector_shift) ? DIOCH_DATA : DIOCH_METADATA;
+		if (op == 'R')
+			DIO_ReadBytesHint(dio, offset, buffer, length, hint);
+		else
+			DIO_WriteBytesHint(dio, offset, buffer, length, hint);
+	}
+	DIO_FlushIOCache(dio);
+	fclose(trace);
+
+	printf("cache: %u pages of %u bytes\n", (unsigned)dio->block_cache->max_cache_nodes,
+		(unsigned)dio->cache_page_size);
+	printf("metadata sectors read: %u of %u requested\n", (unsigned)device_reads[0], (unsigned)requested[0]);
+	printf("data sectors read: %u of %u requested\n", (unsigned)device_reads[1], (unsigned)requested[1]);
+	printf("device writes: %u\n", (unsigned)device_writes);
+
+	return 0;
+}
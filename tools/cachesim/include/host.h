@@ -0,0 +1,245 @@
+/**
+ * Copyright (c) 2015-2026 Fredrik Wikstrom <fredrik@a500.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Just enough of the Amiga headers to build libdiskio on a host. Every
+ * system header that libdiskio includes is a stub that includes this file.
+ */
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef uint32_t           ULONG;
+typedef int32_t            LONG;
+typedef uint16_t           UWORD;
+typedef int16_t            WORD;
+typedef uint8_t            UBYTE;
+typedef int8_t             BYTE;
+typedef void              *APTR;
+typedef const void        *CONST_APTR;
+typedef short              BOOL;
+typedef unsigned char      TEXT;
+typedef TEXT              *STRPTR;
+typedef const TEXT        *CONST_STRPTR;
+typedef uintptr_t          IPTR;
+typedef intptr_t           SIPTR;
+typedef unsigned long long UQUAD;
+typedef long long          QUAD;
+#define AROS_TYPES_DEFINED
+
+#define TRUE  1
+#define FALSE 0
+
+#define ASM
+#define REG(r, a) a
+
+typedef ULONG Tag;
+
+struct TagItem {
+	Tag  ti_Tag;
+	IPTR ti_Data;
+};
+
+#define TAG_END  0
+#define TAG_USER 0x80000000UL
+
+struct MinNode {
+	struct MinNode *mln_Succ;
+	struct MinNode *mln_Pred;
+};
+
+struct MinList {
+	struct MinNode *mlh_Head;
+	struct MinNode *mlh_Tail;
+	struct MinNode *mlh_TailPred;
+};
+
+struct Node {
+	struct Node *ln_Succ;
+	struct Node *ln_Pred;
+	UBYTE        ln_Type;
+	BYTE         ln_Pri;
+	char        *ln_Name;
+};
+
+struct List {
+	struct Node *lh_Head;
+	struct Node *lh_Tail;
+	struct Node *lh_TailPred;
+	UBYTE        lh_Type;
+	UBYTE        l_pad;
+};
+
+#define NT_INTERRUPT 2
+
+struct Interrupt {
+	struct Node is_Node;
+	APTR        is_Data;
+	void      (*is_Code)();
+};
+
+struct ExecBase {
+	int dummy;
+};
+
+struct MemHandlerData {
+	ULONG memh_RequestSize;
+	ULONG memh_RequestFlags;
+	ULONG memh_Flags;
+};
+
+#define MEM_DID_NOTHING 0
+#define MEM_ALL_DONE    -1
+#define MEM_TRY_AGAIN   1
+
+#define MEMF_PUBLIC (1UL << 0)
+#define MEMF_FAST   (1UL << 2)
+#define MEMF_CLEAR  (1UL << 16)
+#define MEMF_TOTAL  (1UL << 19)
+
+struct Device;
+struct Unit;
+struct MsgPort;
+
+struct Message {
+	struct Node     mn_Node;
+	struct MsgPort *mn_ReplyPort;
+	UWORD           mn_Length;
+};
+
+struct IORequest {
+	struct Message io_Message;
+	struct Device *io_Device;
+	struct Unit   *io_Unit;
+	UWORD          io_Command;
+	UBYTE          io_Flags;
+	BYTE           io_Error;
+};
+
+struct IOStdReq {
+	struct Message io_Message;
+	struct Device *io_Device;
+	struct Unit   *io_Unit;
+	UWORD          io_Command;
+	UBYTE          io_Flags;
+	BYTE           io_Error;
+	ULONG          io_Actual;
+	ULONG          io_Length;
+	APTR           io_Data;
+	ULONG          io_Offset;
+};
+
+struct IOExtTD {
+	struct IOStdReq iotd_Req;
+	ULONG           iotd_Count;
+	ULONG           iotd_SecLabel;
+};
+
+#define CMD_INVALID 0
+#define CMD_READ    2
+#define CMD_WRITE   3
+#define CMD_UPDATE  4
+
+#define IOERR_NOCMD      -3
+#define IOERR_BADADDRESS -5
+
+struct DateStamp {
+	LONG ds_Days;
+	LONG ds_Minute;
+	LONG ds_Tick;
+};
+
+#define TICKS_PER_SECOND 50
+
+static inline void AddHead(struct List *list, struct Node *node) {
+	node->ln_Succ = list->lh_Head;
+	node->ln_Pred = (struct Node *)&list->lh_Head;
+	list->lh_Head->ln_Pred = node;
+	list->lh_Head = node;
+}
+
+static inline void AddTail(struct List *list, struct Node *node) {
+	node->ln_Succ = (struct Node *)&list->lh_Tail;
+	node->ln_Pred = list->lh_TailPred;
+	list->lh_TailPred->ln_Succ = node;
+	list->lh_TailPred = node;
+}
+
+static inline void Remove(struct Node *node) {
+	node->ln_Pred->ln_Succ = node->ln_Succ;
+	node->ln_Succ->ln_Pred = node->ln_Pred;
+}
+
+static inline void Insert(struct List *list, struct Node *node, struct Node *pred) {
+	if (pred == NULL) {
+		AddHead(list, node);
+		return;
+	}
+	node->ln_Succ = pred->ln_Succ;
+	node->ln_Pred = pred;
+	pred->ln_Succ->ln_Pred = node;
+	pred->ln_Succ = node;
+}
+
+static inline void CopyMem(const void *src, void *dest, ULONG size) {
+	memcpy(dest, src, size);
+}
+
+static inline APTR CreatePool(ULONG flags, ULONG puddle_size, ULONG threshold) {
+	return (APTR)1;
+}
+
+static inline void DeletePool(APTR pool) {
+}
+
+static inline APTR AllocPooled(APTR pool, ULONG size) {
+	return malloc(size);
+}
+
+static inline void FreePooled(APTR pool, APTR mem, ULONG size) {
+	free(mem);
+}
+
+static inline APTR AllocVec(ULONG size, ULONG flags) {
+	return (flags & MEMF_CLEAR) ? calloc(1, size) : malloc(size);
+}
+
+static inline void FreeVec(APTR mem) {
+	free(mem);
+}
+
+static inline void AddMemHandler(struct Interrupt *handler) {
+}
+
+static inline void RemMemHandler(struct Interrupt *handler) {
+}
+
+/* mockdev.c */
+ULONG AvailMem(ULONG flags);
+LONG DoIO(struct IORequest *ior);
+void SendIO(struct IORequest *ior);
+LONG WaitIO(struct IORequest *ior);
+BOOL CheckIO(struct IORequest *ior);
+void DateStamp(struct DateStamp *ds);
+
+#endif
@@ -0,0 +1,11 @@
+/* Types that libexfat takes from filesysbox.library, for host builds */
+#ifndef LIBRARIES_FILESYSBOX_H
+#define LIBRARIES_FILESYSBOX_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+typedef off_t fbx_off_t;
+#define fbx_stat stat
+
+#endif
@@ -0,0 +1,198 @@
+/**
+ * Copyright (c) 2015-2026 Fredrik Wikstrom <fredrik@a500.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * A RAM disk that stands in for the exec device under libdiskio, and a
+ * replacement for DIO_Setup() that needs no DOS device node.
+ */
+
+#include "diskio_internal.h"
+#include "mockdev.h"
+#include <stdio.h>
+
+#define QUEUE_SIZE NUM_IO_REQUESTS
+
+static UBYTE *disk;
+static UQUAD disk_size;
+static ULONG avail_mem;
+static void (*io_hook)(BOOL write, UQUAD offset, ULONG length);
+
+/* Queued requests complete in order, like they would in a device task */
+static struct IORequest *queue[QUEUE_SIZE];
+static int queued;
+
+static LONG PerformIO(struct IORequest *ior) {
+	struct IOExtTD *iotd = (struct IOExtTD *)ior;
+	UQUAD offset = ((UQUAD)iotd->iotd_Req.io_Actual << 32) | iotd->iotd_Req.io_Offset;
+	ULONG length = iotd->iotd_Req.io_Length;
+
+	switch (iotd->iotd_Req.io_Command) {
+		case CMD_READ:
+		case CMD_WRITE:
+			if (offset + length > disk_size)
+				return ior->io_Error = IOERR_BADADDRESS;
+			if (io_hook != NULL)
+				io_hook(iotd->iotd_Req.io_Command == CMD_WRITE, offset, length);
+			if (iotd->iotd_Req.io_Command == CMD_READ)
+				memcpy(iotd->iotd_Req.io_Data, disk + offset, length);
+			else
+				memcpy(disk + offset, iotd->iotd_Req.io_Data, length);
+			break;
+	}
+
+	return ior->io_Error = 0;
+}
+
+static void CompleteOne(void) {
+	struct IORequest *ior = queue[0];
+	int i;
+
+	PerformIO(ior);
+	for (i = 1; i < queued; i++)
+		queue[i - 1] = queue[i];
+	queued--;
+}
+
+LONG DoIO(struct IORequest *ior) {
+	while (queued > 0)
+		CompleteOne();
+	return PerformIO(ior);
+}
+
+void SendIO(struct IORequest *ior) {
+	if (queued == QUEUE_SIZE)
+		CompleteOne();
+	queue[queued++] = ior;
+}
+
+LONG WaitIO(struct IORequest *ior) {
+	int i;
+
+	for (i = 0; i < queued; i++) {
+		if (queue[i] == ior) {
+			while (queue[0] != ior)
+				CompleteOne();
+			CompleteOne();
+			break;
+		}
+	}
+	return ior->io_Error;
+}
+
+BOOL CheckIO(struct IORequest *ior) {
+	return TRUE;
+}
+
+ULONG AvailMem(ULONG flags) {
+	return avail_mem;
+}
+
+void DateStamp(struct DateStamp *ds) {
+	memset(ds, 0, sizeof(*ds));
+}
+
+int debugf(const char *fmt, ...) {
+	return 0;
+}
+
+int DiskIOMemHandler(struct ExecBase *SysBase, APTR custom, APTR data) {
+	return MEM_DID_NOTHING;
+}
+
+void SetSectorSize(struct DiskIO *dio, ULONG sector_size) {
+	dio->sector_size  = sector_size;
+	dio->sector_shift = __builtin_ctz(sector_size);
+	dio->sector_mask  = sector_size - 1;
+}
+
+void MockSetIOHook(void (*hook)(BOOL write, UQUAD offset, ULONG length)) {
+	io_hook = hook;
+}
+
+struct DiskIO *MockSetup(UQUAD size, ULONG sector_size, ULONG memory, const struct TagItem *tags) {
+	struct DiskIO *dio;
+	const struct TagItem *tag;
+	int i;
+
+	disk = calloc(1, size);
+	dio = calloc(1, sizeof(*dio));
+	if (disk == NULL || dio == NULL) {
+		free(disk);
+		free(dio);
+		return NULL;
+	}
+	disk_size = size;
+	avail_mem = memory;
+
+	/* Same defaults as DIO_Setup() */
+	dio->cache_enabled       = TRUE;
+	dio->write_cache_enabled = TRUE;
+	dio->cache_page_size     = 4096;
+	dio->cache_policy        = DIOCP_SLRU;
+	dio->cache_verify        = DIOCV_ALWAYS;
+	dio->verify_period       = 16;
+	dio->writeback_age       = 5;
+
+	for (tag = tags; tag != NULL && tag->ti_Tag != TAG_END; tag++) {
+		switch (tag->ti_Tag) {
+			case DIOS_WriteCache:
+				dio->write_cache_enabled = !!tag->ti_Data;
+				break;
+			case DIOS_CachePageSize:
+				dio->cache_page_size = tag->ti_Data;
+				break;
+			case DIOS_CacheVerify:
+				dio->cache_verify = tag->ti_Data;
+				break;
+			case DIOS_VerifyPeriod:
+				dio->verify_period = tag->ti_Data;
+				break;
+			case DIOS_CachePolicy:
+				dio->cache_policy = tag->ti_Data;
+				break;
+			case DIOS_WriteBackAge:
+				dio->writeback_age = tag->ti_Data;
+				break;
+		}
+	}
+
+	dio->mempool  = CreatePool(MEMF_PUBLIC, 4096, 1024);
+	dio->diskiotd = calloc(1, sizeof(struct IOExtTD));
+	for (i = 0; i < NUM_IO_REQUESTS; i++)
+		dio->io_ring[i].iotd = calloc(1, sizeof(struct IOExtTD));
+
+	SetSectorSize(dio, sector_size);
+	dio->read_cmd       = CMD_READ;
+	dio->write_cmd      = CMD_WRITE;
+	dio->update_cmd     = CMD_UPDATE;
+	dio->partition_size = size;
+	dio->total_sectors  = size >> dio->sector_shift;
+
+	dio->read_buffer_size = (64UL * 1024UL) >> dio->sector_shift;
+	dio->read_buffer      = malloc(dio->read_buffer_size << dio->sector_shift);
+	dio->max_cached_read  = dio->read_buffer_size;
+	dio->max_cached_write = dio->read_buffer_size;
+
+	dio->block_cache  = InitBlockCache(dio);
+	dio->disk_present = TRUE;
+	dio->disk_ok      = TRUE;
+	if (dio->block_cache == NULL || dio->read_buffer == NULL)
+		return NULL;
+
+	return dio;
+}
@@ -0,0 +1,7 @@
+#ifndef MOCKDEV_H
+#define MOCKDEV_H
+
+void MockSetIOHook(void (*hook)(BOOL write, UQUAD offset, ULONG length));
+struct DiskIO *MockSetup(UQUAD size, ULONG sector_size, ULONG memory, const struct TagItem *tags);
+
+#endif
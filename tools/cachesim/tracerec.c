@@ -0,0 +1,292 @@
+/**
+ * Copyright (c) 2015-2026 Fredrik Wikstrom <fredrik@a500.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Records the device accesses of an exFAT workload for cachesim: a large
+ * file is copied in 16 KB chunks while small files in 16 directories are
+ * appended to, read and have their entries updated. The image is created
+ * and formatted first. Accesses are captured by wrapping pread64() and
+ * pwrite64() at link time, see the Makefile.
+ */
+
+#include "exfat.h"
+#include "mkfs/mkexfat.h"
+#include "mkfs/vbr.h"
+#include "mkfs/fat.h"
+#include "mkfs/cbm.h"
+#include "mkfs/uct.h"
+#include "mkfs/rootdir.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#define VOLUME_SIZE (256 * 1024 * 1024)
+#define SOURCE_SIZE (40 * 1024 * 1024)
+#define COPY_SIZE (5 * 1024 * 1024)
+#define CHUNK_SIZE (16 * 1024)
+#define DIRS 16
+#define FILES 24
+
+const struct fs_object* objects[] =
+{
+	&vbr,
+	&vbr,
+	&fat,
+	&cbm,
+	&uct,
+	&rootdir,
+	NULL,
+};
+
+static struct exfat ef;
+static FILE* trace;
+static bool recording;
+static char buffer[64 * 1024];
+static uint64_t seed = 88172645463325252ULL;
+
+ssize_t __real_pread64(int fd, void* buf, size_t size, off_t offset);
+ssize_t __real_pwrite64(int fd, const void* buf, size_t size, off_t offset);
+
+ssize_t __wrap_pread64(int fd, void* buf, size_t size, off_t offset)
+{
+	if (recording)
+		fprintf(trace, "R %"PRIu64" %zu\n", (uint64_t) offset, size);
+	return __real_pread64(fd, buf, size, offset);
+}
+
+ssize_t __wrap_pwrite64(int fd, const void* buf, size_t size, off_t offset)
+{
+	if (recording)
+		fprintf(trace, "W %"PRIu64" %zu\n", (uint64_t) offset, size);
+	return __real_pwrite64(fd, buf, size, offset);
+}
+
+int get_sector_bits(void)
+{
+	return 9;
+}
+
+int get_spc_bits(void)
+{
+	return 3;
+}
+
+fbx_off_t get_volume_size(void)
+{
+	return VOLUME_SIZE;
+}
+
+const le16_t* get_volume_label(void)
+{
+	static const le16_t label[EXFAT_ENAME_MAX + 1];
+
+	return label;
+}
+
+uint32_t get_volume_serial(void)
+{
+	return 0x12345678;
+}
+
+uint64_t get_first_sector(void)
+{
+	return 0;
+}
+
+int get_sector_size(void)
+{
+	return 1 << get_sector_bits();
+}
+
+int get_cluster_size(void)
+{
+	return get_sector_size() << get_spc_bits();
+}
+
+static unsigned random_number(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static void check(int ok, const char* what)
+{
+	if (!ok)
+		exfat_bug("%s failed", what);
+}
+
+static void format_image(const char* path)
+{
+	struct exfat_dev* dev;
+	int fd;
+
+	fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	check(fd != -1, "creating the image");
+	check(ftruncate(fd, VOLUME_SIZE) == 0, "sizing the image");
+	close(fd);
+
+	dev = exfat_open(path, EXFAT_MODE_RW, "");
+	check(dev != NULL, "opening the image");
+	check(mkfs(dev, VOLUME_SIZE) == 0, "formatting");
+	check(exfat_close(dev) == 0, "closing the image");
+}
+
+static struct exfat_node* lookup_file(int dir, int file)
+{
+	char path[64];
+	struct exfat_node* node;
+
+	snprintf(path, sizeof(path), "/d%d/f%d", dir, file);
+	check(exfat_lookup(&ef, &node, path) == 0, "lookup");
+	return node;
+}
+
+static void append(int dir, int file, size_t size)
+{
+	struct exfat_node* node = lookup_file(dir, file);
+
+	check(exfat_generic_pwrite(&ef, node, buffer, size, node->size) ==
+			(ssize_t) size, "append");
+	check(exfat_flush_node(&ef, node) == 0, "flush");
+	exfat_put_node(&ef, node);
+}
+
+static void read_some(int dir, int file)
+{
+	struct exfat_node* node = lookup_file(dir, file);
+
+	check(exfat_generic_pread(&ef, node, buffer, 4096,
+			(random_number() % 4) * 4096) == 4096, "read");
+	check(exfat_flush_node(&ef, node) == 0, "flush");
+	exfat_put_node(&ef, node);
+}
+
+/* Writes the extents of all regular files, so cachesim can tell data from
+   metadata. */
+static void write_data_extents(struct exfat_node* dir)
+{
+	struct exfat_iterator it;
+	struct exfat_node* node;
+	cluster_t cluster;
+	uint64_t i, count;
+
+	check(exfat_opendir(&ef, dir, &it) == 0, "opendir");
+	while ((node = exfat_readdir(&ef, &it)) != NULL)
+	{
+		if (node->flags & EXFAT_ATTRIB_DIR)
+			write_data_extents(node);
+		else
+		{
+			cluster = node->start_cluster;
+			count = DIV_ROUND_UP(node->size, CLUSTER_SIZE(*ef.sb));
+			for (i = 0; i < count; i++)
+			{
+				fprintf(trace, "D %"PRIu64" %u\n", exfat_c2o(&ef, cluster),
+						CLUSTER_SIZE(*ef.sb));
+				cluster = exfat_next_cluster(&ef, node, cluster);
+			}
+		}
+		exfat_put_node(&ef, node);
+	}
+	exfat_closedir(&ef, &it);
+}
+
+int main(int argc, char* argv[])
+{
+	struct exfat_node* source;
+	struct exfat_node* copy;
+	char path[64];
+	size_t offset;
+	int d, f, i, k;
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "Usage: %s <image> <trace>\n", argv[0]);
+		return 1;
+	}
+
+	format_image(argv[1]);
+	check(exfat_mount(&ef, argv[1], "") == 0, "mount");
+
+	/* Files that grow in turns end up fragmented */
+	for (d = 0; d < DIRS; d++)
+	{
+		snprintf(path, sizeof(path), "/d%d", d);
+		check(exfat_mkdir(&ef, path) == 0, "mkdir");
+		for (f = 0; f < FILES; f++)
+		{
+			snprintf(path, sizeof(path), "/d%d/f%d", d, f);
+			check(exfat_mknod(&ef, path) == 0, "mknod");
+		}
+	}
+	for (i = 0; i < 4; i++)
+		for (d = 0; d < DIRS; d++)
+			for (f = 0; f < FILES; f++)
+				append(d, f, 4096);
+
+	check(exfat_mknod(&ef, "/source") == 0, "mknod");
+	check(exfat_lookup(&ef, &source, "/source") == 0, "lookup");
+	for (offset = 0; offset < SOURCE_SIZE; offset += sizeof(buffer))
+		check(exfat_generic_pwrite(&ef, source, buffer, sizeof(buffer),
+				offset) == sizeof(buffer), "write");
+	check(exfat_flush_node(&ef, source) == 0, "flush");
+	check(exfat_flush(&ef) == 0, "flush");
+
+	trace = fopen(argv[2], "w");
+	check(trace != NULL, "creating the trace");
+	fprintf(trace, "S %d %d\n", VOLUME_SIZE, get_sector_size());
+	recording = true;
+
+	for (i = 0; i < 8; i++)
+	{
+		snprintf(path, sizeof(path), "/copy%d", i);
+		check(exfat_mknod(&ef, path) == 0, "mknod");
+		check(exfat_lookup(&ef, &copy, path) == 0, "lookup");
+		for (offset = 0, k = 0; offset < COPY_SIZE; offset += CHUNK_SIZE, k++)
+		{
+			size_t from = ((size_t) i * COPY_SIZE + offset) % SOURCE_SIZE;
+
+			check(exfat_generic_pread(&ef, source, buffer, CHUNK_SIZE,
+					from) == CHUNK_SIZE, "read");
+			check(exfat_generic_pwrite(&ef, copy, buffer, CHUNK_SIZE,
+					offset) == CHUNK_SIZE, "write");
+			/* metadata traffic every 128 KB */
+			if (k % 8 == 7)
+			{
+				append(random_number() % DIRS, random_number() % FILES,
+						100 + random_number() % 900);
+				read_some(random_number() % DIRS, random_number() % FILES);
+			}
+		}
+		check(exfat_flush_node(&ef, copy) == 0, "flush");
+		exfat_put_node(&ef, copy);
+		check(exfat_flush(&ef) == 0, "flush");
+	}
+	check(exfat_flush_node(&ef, source) == 0, "flush");
+	exfat_put_node(&ef, source);
+
+	recording = false;
+	write_data_extents(ef.root);
+	check(fclose(trace) == 0, "writing the trace");
+
+	exfat_unmount(&ef);
+	return 0;
+}
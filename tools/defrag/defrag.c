@@ -0,0 +1,172 @@
+/**
+ * Copyright (c) 2015-2026 Fredrik Wikstrom <fredrik@a500.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Defragments files on an exFAT image or device with exfat_defragment() and
+ * reports the number of fragments of each fragmented file before and after.
+ * Without paths all files of the volume are processed. With -n fragments
+ * are only counted.
+ */
+
+#include "exfat.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+static struct exfat ef;
+static bool dry_run;
+static uint32_t files, fragmented, fragments_before, fragments_after;
+
+static int defragment_file(const char* path, struct exfat_node* node)
+{
+	uint32_t before, after;
+	int rc;
+
+	rc = exfat_count_fragments(&ef, node, &before);
+	if (rc != 0)
+		return rc;
+	files++;
+	fragments_before += before;
+	if (before > 1 && !dry_run)
+	{
+		rc = exfat_defragment(&ef, node);
+		if (rc != 0)
+		{
+			exfat_error("failed to defragment '%s': %s", path, strerror(-rc));
+			return rc;
+		}
+		rc = exfat_count_fragments(&ef, node, &after);
+		if (rc != 0)
+			return rc;
+	}
+	else
+		after = before;
+	fragments_after += after;
+	if (before > 1)
+	{
+		fragmented++;
+		printf("%s: %"PRIu32" -> %"PRIu32" fragments\n", path, before, after);
+	}
+	return 0;
+}
+
+static int defragment_tree(const char* path, struct exfat_node* dir)
+{
+	struct exfat_iterator it;
+	struct exfat_node* node;
+	char name[UTF8_BYTES(EXFAT_NAME_MAX) + 1];
+	char* child;
+	int rc;
+
+	rc = exfat_opendir(&ef, dir, &it);
+	if (rc != 0)
+		return rc;
+	while ((node = exfat_readdir(&ef, &it)) != NULL)
+	{
+		exfat_get_name(node, name, sizeof(name) - 1);
+		child = malloc(strlen(path) + strlen(name) + 2);
+		if (child == NULL)
+		{
+			exfat_put_node(&ef, node);
+			rc = -ENOMEM;
+			break;
+		}
+		sprintf(child, "%s/%s", strcmp(path, "/") == 0 ? "" : path, name);
+		if (node->flags & EXFAT_ATTRIB_DIR)
+			rc = defragment_tree(child, node);
+		else
+			rc = defragment_file(child, node);
+		free(child);
+		exfat_put_node(&ef, node);
+		if (rc != 0)
+			break;
+	}
+	exfat_closedir(&ef, &it);
+	return rc;
+}
+
+static int defragment_path(const char* path)
+{
+	struct exfat_node* node;
+	int rc;
+
+	rc = exfat_lookup(&ef, &node, path);
+	if (rc != 0)
+	{
+		exfat_error("failed to look up '%s': %s", path, strerror(-rc));
+		return rc;
+	}
+	if (node->flags & EXFAT_ATTRIB_DIR)
+		rc = defragment_tree(path, node);
+	else
+		rc = defragment_file(path, node);
+	exfat_put_node(&ef, node);
+	return rc;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-n] [-o options] <device> [path...]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	const char* options = "";
+	int opt;
+	int rc = 0;
+	int i;
+
+	while ((opt = getopt(argc, argv, "no:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			dry_run = true;
+			break;
+		case 'o':
+			options = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	if (exfat_mount(&ef, argv[optind], options) != 0)
+		return 1;
+	if (ef.ro && !dry_run)
+	{
+		exfat_error("'%s' is read-only", argv[optind]);
+		exfat_unmount(&ef);
+		return 1;
+	}
+
+	if (optind + 1 == argc)
+		rc = defragment_path("/");
+	for (i = optind + 1; i < argc && rc == 0; i++)
+		rc = defragment_path(argv[i]);
+
+	printf("%"PRIu32" of %"PRIu32" files fragmented, "
+			"%"PRIu32" fragments before, %"PRIu32" after\n",
+			fragmented, files, fragments_before, fragments_after);
+	exfat_unmount(&ef);
+	return rc != 0;
+}